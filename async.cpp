@@ -0,0 +1,288 @@
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <cerrno>
+#include <spawn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include "customsh.hpp"
+#include "async.hpp"
+
+namespace sh
+{
+  namespace
+  {
+    struct command;
+
+    /// One fd watched for a command, the `data.ptr` of its epoll event.
+    /// `sink` is where a pipe's output goes, nullptr for the pidfd.
+    struct source
+    {
+      command* cmd;
+      std::string* sink;
+      int fd;
+    };
+
+    struct command
+    {
+      std::function<void(result&)> done;
+      result res;
+      source sources[3];
+      /* Sources not closed yet, the command is done at 0. */
+      int open = 3;
+    };
+
+    /// The thread that owns every running command once it is started.
+    /// Commands are handed over through a queue and an eventfd, so only that
+    /// thread ever touches them.
+    class watcher
+    {
+      int m_epoll;
+      int m_wake;
+      std::mutex m_mutex;
+      std::vector<command*> m_added;
+
+    public:
+      /// Started on first use and left running with the daemon.
+      static watcher& get()
+      {
+        static watcher* instance(new watcher());
+        return *instance;
+      }
+
+      void add(command* cmd)
+      {
+        {
+          std::lock_guard<std::mutex> locker(m_mutex);
+          m_added.push_back(cmd);
+        }
+        const uint64_t one(1);
+        if (::write(m_wake, &one, sizeof(one)) < 0)
+        {
+          /* Already signalled. */
+        }
+      }
+
+    private:
+      watcher()
+        : m_epoll(::epoll_create1(EPOLL_CLOEXEC))
+        , m_wake(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+      {
+        epoll_event event = { EPOLLIN, { nullptr } };
+        if (m_epoll < 0 || m_wake < 0 || ::epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &event) < 0)
+        {
+          const int _errno(errno);
+          if (m_epoll >= 0)
+            ::close(m_epoll);
+          if (m_wake >= 0)
+            ::close(m_wake);
+          throw std::system_error(_errno, std::system_category(), "epoll");
+        }
+        std::thread(&watcher::run, this).detach();
+      }
+
+      [[noreturn]] void run()
+      {
+        epoll_event events[64];
+        while (true)
+        {
+          const int n(::epoll_wait(m_epoll, events, sizeof(events) / sizeof(*events), -1));
+          /* Each fd shows up once per batch, so a command freed below has no later event in it. */
+          for (int i(0); i < n; ++ i)
+          {
+            if (events[i].data.ptr)
+              ready(*static_cast<source*>(events[i].data.ptr));
+            else
+              watch();
+          }
+        }
+      }
+
+      void watch()
+      {
+        uint64_t wakes;
+        if (::read(m_wake, &wakes, sizeof(wakes)) < 0)
+        {
+          /* Drained by a previous batch. */
+        }
+        std::vector<command*> added;
+        {
+          std::lock_guard<std::mutex> locker(m_mutex);
+          added.swap(m_added);
+        }
+        for (auto cmd : added)
+        {
+          source* failed[3];
+          int count(0);
+          for (auto& src : cmd->sources)
+          {
+            epoll_event event = { EPOLLIN, { &src } };
+            if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, src.fd, &event) < 0)
+            {
+              error() << "cannot watch" << src.fd << errno;
+              failed[count ++] = &src;
+            }
+          }
+          /* Lose that output, or reap the slow way. The last close frees the command. */
+          for (int i(0); i < count; ++ i)
+          {
+            if (!failed[i]->sink)
+              reap(*failed[i], 0);
+            close(*failed[i]);
+          }
+        }
+      }
+
+      void ready(source& src)
+      {
+        if (!src.sink)
+        {
+          if (reap(src, WNOHANG))
+            close(src);
+          return;
+        }
+        char buffer[16384];
+        while (true)
+        {
+          const auto n(::read(src.fd, buffer, sizeof(buffer)));
+          if (n > 0)
+          {
+            src.sink->append(buffer, n);
+            continue;
+          }
+          if (n < 0 && errno == EINTR)
+            continue;
+          if (n < 0 && errno == EAGAIN)
+            return;
+          break;
+        }
+        close(src);
+      }
+
+      /// Returns false when the child is still running.
+      bool reap(source& src, int flags)
+      {
+        siginfo_t info;
+        info.si_pid = 0;
+        int reaped;
+        do
+        {
+          reaped = ::waitid(P_PIDFD, src.fd, &info, WEXITED | flags);
+        }
+        while (reaped < 0 && errno == EINTR);
+        if (reaped < 0)
+          return true;
+        if (!info.si_pid)
+          return false;
+        src.cmd->res.code = info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status;
+        return true;
+      }
+
+      void close(source& src)
+      {
+        ::epoll_ctl(m_epoll, EPOLL_CTL_DEL, src.fd, nullptr);
+        ::close(src.fd);
+        auto cmd(src.cmd);
+        if (-- cmd->open)
+          return;
+        try
+        {
+          cmd->done(cmd->res);
+        }
+        catch (const std::exception& e)
+        {
+          error() << "async completion failed" << e.what();
+        }
+        delete cmd;
+      }
+    };
+  }
+
+  void async(const std::vector<std::string>& argv, std::function<void(result&)> done)
+  {
+    if (argv.empty())
+      throw std::system_error(EINVAL, std::system_category(), "async");
+    auto& watcher(watcher::get());
+
+    std::vector<const char*> args;
+    for (auto& arg : argv)
+      args.push_back(arg.c_str());
+    args.push_back(nullptr);
+
+    int out[2], err[2];
+    if (::pipe2(out, O_CLOEXEC) < 0)
+      throw std::system_error(errno, std::system_category(), "pipe");
+    if (::pipe2(err, O_CLOEXEC) < 0)
+    {
+      const int _errno(errno);
+      ::close(out[0]);
+      ::close(out[1]);
+      throw std::system_error(_errno, std::system_category(), "pipe");
+    }
+
+    posix_spawn_file_actions_t actions;
+    ::posix_spawn_file_actions_init(&actions);
+    ::posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    ::posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    ::posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+    ::posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+    posix_spawnattr_t attr;
+    ::posix_spawnattr_init(&attr);
+    sigset_t defaults;
+    ::sigemptyset(&defaults);
+    ::sigaddset(&defaults, SIGINT);
+    ::sigaddset(&defaults, SIGHUP);
+    ::sigaddset(&defaults, SIGPIPE);
+    ::posix_spawnattr_setsigdefault(&attr, &defaults);
+    ::posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    const int spawned(::posix_spawnp(&pid, args[0], &actions, &attr, (char* const*)args.data(), environ));
+    ::posix_spawn_file_actions_destroy(&actions);
+    ::posix_spawnattr_destroy(&attr);
+    ::close(out[1]);
+    ::close(err[1]);
+
+    const int pidfd(spawned ? -1 : ::syscall(SYS_pidfd_open, pid, 0));
+    if (pidfd < 0)
+    {
+      const int _errno(spawned ? spawned : errno);
+      ::close(out[0]);
+      ::close(err[0]);
+      if (!spawned)
+      {
+        ::kill(pid, SIGKILL);
+        int status;
+        ::waitpid(pid, &status, 0);
+      }
+      throw std::system_error(_errno, std::system_category(), spawned ? args[0] : "pidfd_open");
+    }
+    /* The read ends only, the child keeps blocking writes. */
+    ::fcntl(out[0], F_SETFL, ::fcntl(out[0], F_GETFL) | O_NONBLOCK);
+    ::fcntl(err[0], F_SETFL, ::fcntl(err[0], F_GETFL) | O_NONBLOCK);
+
+    auto cmd(new command());
+    cmd->done = std::move(done);
+    cmd->sources[0] = { cmd, &cmd->res.out, out[0] };
+    cmd->sources[1] = { cmd, &cmd->res.err, err[0] };
+    cmd->sources[2] = { cmd, nullptr, pidfd };
+    watcher.add(cmd);
+  }
+
+  std::future<result> async(const std::vector<std::string>& argv)
+  {
+    auto promise(std::make_shared<std::promise<result>>());
+    auto future(promise->get_future());
+    async(argv, [promise](result& res)
+    {
+      promise->set_value(std::move(res));
+    });
+    return future;
+  }
+}
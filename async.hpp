@@ -0,0 +1,33 @@
+#ifndef ASYNC_HPP
+#define ASYNC_HPP
+
+#include <string>
+#include <vector>
+#include <future>
+#include <functional>
+
+namespace sh
+{
+  /// What a command left behind once it exited and closed its output.
+  struct result
+  {
+    /* Exit status, 128 + signal when killed. */
+    int code = -1;
+    std::string out;
+    std::string err;
+  };
+
+  /// Runs `argv` without waiting for it: stdin is /dev/null, stdout and
+  /// stderr are collected by a background thread that watches them with
+  /// epoll, along with a pidfd to reap the child as soon as it exits. The
+  /// calling thread returns right away and `done` is called from that
+  /// background thread once the output is closed and the child reaped, so it
+  /// must not block. The command runs in the calling thread's namespaces.
+  /// Throws `std::system_error` when it cannot be started.
+  void async(const std::vector<std::string>& argv, std::function<void(result&)> done);
+
+  /// Same, with the result delivered through a future.
+  std::future<result> async(const std::vector<std::string>& argv);
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include "await.hpp"
+
+namespace customsh
+{
+  namespace
+  {
+    std::atomic<executor*> s_executor(nullptr);
+
+    void* here()
+    {
+      auto current(s_executor.load(std::memory_order_acquire));
+      return current ? current->pool() : nullptr;
+    }
+
+    void resume(void* pool, std::coroutine_handle<> handle)
+    {
+      auto current(s_executor.load(std::memory_order_acquire));
+      if (current)
+        current->post(pool, [handle]() { handle.resume(); });
+      else
+        handle.resume();
+    }
+
+    /// One thread for every pending `sleep_for`, started on first use.
+    class timers
+    {
+      std::mutex m_mutex;
+      std::condition_variable m_changed;
+      std::multimap<std::chrono::steady_clock::time_point, std::pair<void*, std::coroutine_handle<>>> m_pending;
+
+    public:
+      static timers& get()
+      {
+        static timers* instance(new timers());
+        return *instance;
+      }
+
+      void add(std::chrono::steady_clock::time_point until, void* pool, std::coroutine_handle<> handle)
+      {
+        std::lock_guard<std::mutex> locker(m_mutex);
+        auto i(m_pending.emplace(until, std::make_pair(pool, handle)));
+        if (i == m_pending.begin())
+          m_changed.notify_one();
+      }
+
+    private:
+      timers()
+      {
+        std::thread(&timers::run, this).detach();
+      }
+
+      [[noreturn]] void run()
+      {
+        std::unique_lock<std::mutex> locker(m_mutex);
+        while (true)
+        {
+          if (m_pending.empty())
+          {
+            m_changed.wait(locker);
+            continue;
+          }
+          auto first(m_pending.begin());
+          if (std::chrono::steady_clock::now() < first->first)
+          {
+            m_changed.wait_until(locker, first->first);
+            continue;
+          }
+          auto handle(first->second);
+          m_pending.erase(first);
+          locker.unlock();
+          resume(handle.first, handle.second);
+          locker.lock();
+        }
+      }
+    };
+  }
+
+  void executor::install(executor* value)
+  {
+    s_executor.store(value, std::memory_order_release);
+  }
+
+  void sleeping::await_suspend(std::coroutine_handle<> handle)
+  {
+    m_pool = here();
+    timers::get().add(m_until, m_pool, handle);
+  }
+
+  void running::await_suspend(std::coroutine_handle<> handle)
+  {
+    m_pool = here();
+    sh::async(m_argv, [this, handle](sh::result& res)
+    {
+      m_result = std::move(res);
+      resume(m_pool, handle);
+    });
+  }
+
+  /// Resumes the caller once with the reply, or with `bad_argument` when the
+  /// request got dropped without one.
+  class calling::answer : public deferred
+  {
+    calling& m_call;
+    std::coroutine_handle<> m_handle;
+    std::atomic<bool> m_answered;
+  public:
+    answer(calling& call, std::coroutine_handle<> handle) : m_call(call), m_handle(handle), m_answered(false) { }
+    ~answer()
+    {
+      fail(bad_argument());
+    }
+    void send(const std::string& payload)
+    {
+      if (m_answered.exchange(true))
+        return;
+      m_call.m_reply = payload;
+      resume(m_call.m_pool, m_handle);
+    }
+    void fail(const std::exception& error)
+    {
+      if (m_answered.exchange(true))
+        return;
+      if (dynamic_cast<const not_found*>(&error))
+        m_call.m_error = std::make_exception_ptr(not_found());
+      else
+        m_call.m_error = std::make_exception_ptr(bad_argument());
+      resume(m_call.m_pool, m_handle);
+    }
+  };
+
+  void calling::await_suspend(std::coroutine_handle<> handle)
+  {
+    auto current(s_executor.load(std::memory_order_acquire));
+    if (!current)
+      throw bad_argument();
+    m_pool = current->pool();
+    current->submit(m_query, std::make_shared<answer>(*this, handle));
+  }
+
+  std::string calling::await_resume()
+  {
+    if (m_error)
+      std::rethrow_exception(m_error);
+    return std::move(m_reply);
+  }
+}
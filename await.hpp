@@ -0,0 +1,93 @@
+#ifndef AWAIT_HPP
+#define AWAIT_HPP
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <coroutine>
+#include "customsh.hpp"
+#include "async.hpp"
+
+namespace customsh
+{
+  /// What coroutine handlers need from the event loop, installed by it at
+  /// startup. Coroutines resume in the pool of workers they suspended in.
+  /// Without an executor, they resume on the thread that completed what
+  /// they waited for and `call()` fails.
+  class executor
+  {
+  public:
+    virtual ~executor() { }
+    /// The pool of workers the calling thread belongs to, nullptr for any
+    /// other thread.
+    virtual void* pool() = 0;
+    /// Runs `work` on a worker of `pool`, of the default one for nullptr.
+    virtual void post(void* pool, std::function<void()> work) = 0;
+    /// Runs `query` like a client request would, with the same object
+    /// ownership, and answers through `reply`.
+    virtual void submit(const std::string& query, deferred_ptr reply) = 0;
+
+    static void install(executor* value);
+  };
+
+  /// `co_await sleep_for(...)` resumes on a worker once `delay` is over.
+  class sleeping
+  {
+    std::chrono::steady_clock::time_point m_until;
+    void* m_pool = nullptr;
+  public:
+    sleeping(std::chrono::steady_clock::time_point until) : m_until(until) { }
+    bool await_ready() const { return m_until <= std::chrono::steady_clock::now(); }
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const { }
+  };
+
+  inline sleeping sleep_for(std::chrono::steady_clock::duration delay)
+  {
+    return sleeping(std::chrono::steady_clock::now() + delay);
+  }
+
+  /// `co_await run({...})` starts a command with `sh::async` and resumes on a
+  /// worker with its result. Throws `std::system_error` when it cannot start.
+  class running
+  {
+    std::vector<std::string> m_argv;
+    void* m_pool = nullptr;
+    sh::result m_result;
+  public:
+    running(std::vector<std::string> argv) : m_argv(std::move(argv)) { }
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    sh::result await_resume() { return std::move(m_result); }
+  };
+
+  inline running run(std::vector<std::string> argv)
+  {
+    return running(std::move(argv));
+  }
+
+  /// `co_await call("...")` answers a query through its module as a client
+  /// request would, and resumes on a worker with the reply. Throws what the
+  /// handler threw, `not_found` or `bad_argument`.
+  class calling
+  {
+    std::string m_query;
+    std::string m_reply;
+    std::exception_ptr m_error;
+    void* m_pool = nullptr;
+    class answer;
+  public:
+    calling(std::string query) : m_query(std::move(query)) { }
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    std::string await_resume();
+  };
+
+  inline calling call(std::string query)
+  {
+    return calling(std::move(query));
+  }
+}
+
+#endif
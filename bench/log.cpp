@@ -0,0 +1,91 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../customsh.hpp"
+
+/// Cost of one `info() << "call" << query` line on the calling thread, for
+/// 1 to 8 threads logging at once into a file: the asynchronous logger with
+/// both overflow policies against the previous behaviour, a write(2) per
+/// line as `std::endl` did. Also checks no line went missing when blocking.
+
+namespace
+{
+  using clock = std::chrono::steady_clock;
+
+  const std::size_t lines = 200000;
+  const std::string query("show mtu eth0");
+
+  /// The previous flush(): the same line, written out right away.
+  void legacy(int fd)
+  {
+    std::string line;
+    line.append(customsh::logger::thread_id()).append("|main.cpp:342(bool answer())").append(": ").append(" \"call\" \"").append(query).append("\"\n");
+    if (write(fd, line.data(), line.size()) < 0)
+      std::exit(1);
+  }
+
+  double run(int threads, const std::function<void()>& log)
+  {
+    std::vector<std::thread> pool;
+    const auto begin(clock::now());
+    for (int t(0); t < threads; ++ t)
+      pool.emplace_back([&]()
+      {
+        for (std::size_t i(0); i < lines / threads; ++ i)
+          log();
+      });
+    std::for_each(pool.begin(), pool.end(), std::mem_fn(&std::thread::join));
+    return std::chrono::duration<double, std::nano>(clock::now() - begin).count() / lines;
+  }
+
+  std::size_t count_lines(const char* path)
+  {
+    auto f(std::fopen(path, "r"));
+    std::size_t count(0);
+    for (int c; (c = std::fgetc(f)) != EOF; )
+      count += c == '\n';
+    std::fclose(f);
+    return count;
+  }
+}
+
+int main()
+{
+  char path[] = "/tmp/customsh-bench-log-XXXXXX";
+  auto fd(mkstemp(path));
+  customsh::logger::sink(fd);
+
+  std::cout << "threads      write(2)    async drop   async block   (ns per line)" << std::endl;
+  std::size_t expected(0);
+  for (int threads : { 1, 2, 4, 8 })
+  {
+    const auto sync(run(threads, [fd]() { legacy(fd); }));
+    customsh::logger::policy(customsh::overflow::drop);
+    const auto drop(run(threads, []() { info() << "call" << query; }));
+    customsh::logger::flush();
+    if (ftruncate(fd, 0) || lseek(fd, 0, SEEK_SET))
+      return 1;
+    customsh::logger::policy(customsh::overflow::block);
+    const auto block(run(threads, []() { info() << "call" << query; }));
+    customsh::logger::flush();
+    expected = lines / threads * threads;
+    const auto written(count_lines(path));
+    std::cout << std::setw(7) << threads << std::fixed << std::setprecision(0)
+      << std::setw(14) << sync << std::setw(14) << drop << std::setw(14) << block
+      << (written == expected ? "" : "   lines missing!") << std::endl;
+    if (ftruncate(fd, 0) || lseek(fd, 0, SEEK_SET))
+      return 1;
+  }
+  close(fd);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,149 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include "../customsh.hpp"
+
+/// modules::get() radix tree against the previous sorted vector lookup,
+/// both over the same 10k registered prefixes.
+
+namespace
+{
+  class dummy : public customsh::module
+  {
+  public:
+    dummy(const std::string& _prefix) : module(_prefix.c_str(), _prefix.size() + 1) { }
+    void call(const std::string&, std::ostream&) { }
+  };
+
+  std::vector<customsh::module_ptr> legacy;
+
+  int legacy_compare(customsh::module_ptr a, const std::string& query)
+  {
+    const auto n(std::memcmp(a->prefix, query.c_str(), std::min(a->prefix_size - 1, query.size())));
+    if (n < 0) return -1;
+    if (n > 0) return  1;
+    return 0;
+  }
+
+  bool legacy_compare_not_equal(customsh::module_ptr a, const std::string& query)
+  {
+    return !!std::memcmp(a->prefix, query.c_str(), std::min(a->prefix_size - 1, query.size()));
+  }
+
+  /// The previous modules::get(), with the bisection direction corrected so
+  /// it finds every entry of a large table.
+  customsh::module_ptr legacy_get(const std::string& query)
+  {
+    std::vector<customsh::module_ptr>::size_type l(0);
+    std::vector<customsh::module_ptr>::size_type r(legacy.size());
+    while (true)
+    {
+      auto i((l + r) / 2);
+      auto m(legacy[i]);
+      auto n(legacy_compare(m, query));
+      if (n == 0)
+      {
+        for (++ i; i < legacy.size(); ++ i)
+        {
+          auto k(legacy[i]);
+          if (legacy_compare_not_equal(k, query))
+            break;
+          m = k;
+        }
+        return m;
+      }
+      else if (i == l)
+      {
+        throw customsh::not_found();
+      }
+      else if (n > 0)
+      {
+        r = i;
+      }
+      else if (n < 0)
+      {
+        l = i + 1;
+      }
+    }
+  }
+
+  template<typename F>
+  double run(unsigned threads, const std::vector<std::string>& queries, F lookup)
+  {
+    const std::size_t rounds(20);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> pool;
+    for (unsigned t(0); t < threads; ++ t)
+    {
+      pool.emplace_back([&]()
+      {
+        while (!go);
+        std::size_t sum(0);
+        for (std::size_t r(0); r < rounds; ++ r)
+          for (auto& q : queries)
+            sum += lookup(q);
+        if (sum == 42)
+          std::cerr << sum;
+      });
+    }
+    auto start(std::chrono::steady_clock::now());
+    go = true;
+    for (auto& t : pool)
+      t.join();
+    std::chrono::duration<double, std::nano> elapsed(std::chrono::steady_clock::now() - start);
+    return elapsed.count() / (rounds * queries.size());
+  }
+}
+
+int main()
+{
+  const std::size_t count(10000);
+  const char* verbs[] = { "show ", "set ", "del ", "add ", "list " };
+  const char* nouns[] = { "interface ", "route ", "address ", "neighbour ", "rule ", "vlan ", "bridge ", "tunnel " };
+  std::vector<std::string> prefixes;
+  prefixes.reserve(count);
+  for (std::size_t i(0); prefixes.size() < count; ++ i)
+    prefixes.emplace_back(std::string(verbs[i % 5]) + nouns[(i / 5) % 8] + "group" + std::to_string(i / 40) + " item" + std::to_string(i % 40) + ' ');
+
+  for (auto& p : prefixes)
+  {
+    auto m(std::make_shared<dummy>(p));
+    customsh::modules::push(m);
+    legacy.emplace_back(m);
+  }
+  customsh::modules::init();
+  std::sort(legacy.begin(), legacy.end(), [](customsh::module_ptr a, customsh::module_ptr b)
+  {
+    const auto n(std::memcmp(a->prefix, b->prefix, std::min(a->prefix_size, b->prefix_size) - 1));
+    return n ? n < 0 : a->prefix_size < b->prefix_size;
+  });
+
+  std::vector<std::string> queries;
+  std::mt19937 rng(1);
+  for (std::size_t i(0); i < 4096; ++ i)
+  {
+    queries.emplace_back(prefixes[rng() % count] + "eth0 up mtu 1500");
+    if (legacy_get(queries.back())->prefix_size != customsh::modules::get(queries.back())->prefix_size)
+      throw customsh::not_found();
+  }
+
+  std::vector<unsigned> threads({ 1, 2, 4, 8 });
+  if (std::thread::hardware_concurrency() > threads.back())
+    threads.emplace_back(std::thread::hardware_concurrency());
+
+  std::cout << "prefixes " << count << ", ns per lookup and thread" << std::endl;
+  std::cout << std::setw(8) << "threads" << std::setw(12) << "vector" << std::setw(12) << "trie" << std::endl;
+  for (auto n : threads)
+  {
+    auto a(run(n, queries, [](const std::string& q) { return legacy_get(q)->prefix_size; }));
+    auto b(run(n, queries, [](const std::string& q) { return customsh::modules::get(q)->prefix_size; }));
+    std::cout << std::fixed << std::setprecision(1)
+      << std::setw(8) << n << std::setw(12) << a << std::setw(12) << b << std::endl;
+  }
+  return 0;
+}
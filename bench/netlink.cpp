@@ -0,0 +1,121 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <sched.h>
+#include <unistd.h>
+#include "../netlink.hpp"
+
+/// Cost per route of installing and removing a routing table: one `ip
+/// route` command each, one rtnetlink request and ACK round trip each,
+/// and `nl::batch`, many requests per sendmsg. Runs in a fresh network
+/// namespace, inside a user namespace of its own when not root, so it
+/// needs no privileges. The `ip` column needs iproute2.
+
+namespace
+{
+  using clock = std::chrono::steady_clock;
+
+  const int routes = 20000;
+  const int commands = 200;
+
+  std::vector<nl::prefix> destinations()
+  {
+    std::vector<nl::prefix> all;
+    for (int i(0); i < routes; ++ i)
+      all.push_back(nl::prefix::parse("10." + std::to_string(i >> 8 & 0xff) + '.' + std::to_string(i & 0xff) + ".0/24"));
+    return all;
+  }
+
+  const std::vector<nl::prefix> nth(destinations());
+
+  bool isolate()
+  {
+    if (unshare(CLONE_NEWNET) == 0)
+      return true;
+    const auto uid(getuid()), gid(getgid());
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNET) < 0)
+      return false;
+    std::ofstream("/proc/self/setgroups") << "deny";
+    std::ofstream("/proc/self/uid_map") << "0 " << uid << " 1";
+    std::ofstream("/proc/self/gid_map") << "0 " << gid << " 1";
+    return true;
+  }
+
+  template<typename F>
+  double run(int count, F f)
+  {
+    const auto begin(clock::now());
+    for (int i(0); i < count; ++ i)
+      f(i);
+    return std::chrono::duration<double, std::nano>(clock::now() - begin).count() / count;
+  }
+
+  double command(const char* what)
+  {
+    return run(commands, [what](int i)
+    {
+      if (std::system(("ip route " + std::string(what) + ' ' + nth[i].str() + " dev lo").c_str()))
+        std::exit(1);
+    });
+  }
+}
+
+int main()
+{
+  if (!isolate())
+  {
+    std::cout << "cannot get a network namespace" << std::endl;
+    return 1;
+  }
+  try
+  {
+    nl::socket rtnl;
+    nl::batch b;
+    auto lo(rtnl.index("lo"));
+    b.link_up(lo, true);
+    rtnl.apply(b);
+
+    const auto ip_add(command("add"));
+    const auto ip_del(command("del"));
+
+    const auto single_add(run(routes, [&](int i) { b.clear(); b.route(nl::op::add, nth[i], nl::prefix(), lo); rtnl.apply(b); }));
+    const auto single_del(run(routes, [&](int i) { b.clear(); b.route(nl::op::del, nth[i], nl::prefix(), lo); rtnl.apply(b); }));
+
+    b.clear();
+    auto begin(clock::now());
+    for (int i(0); i < routes; ++ i)
+      b.route(nl::op::add, nth[i], nl::prefix(), lo);
+    rtnl.apply(b);
+    const auto batch_add(std::chrono::duration<double, std::nano>(clock::now() - begin).count() / routes);
+
+    int installed(0);
+    rtnl.dump(RTM_GETROUTE, AF_INET, [&installed](const nlmsghdr& message)
+    {
+      auto route(static_cast<const rtmsg*>(NLMSG_DATA(&message)));
+      installed += route->rtm_table == RT_TABLE_MAIN && route->rtm_protocol == RTPROT_STATIC;
+    });
+
+    b.clear();
+    begin = clock::now();
+    for (int i(0); i < routes; ++ i)
+      b.route(nl::op::del, nth[i], nl::prefix(), lo);
+    rtnl.apply(b);
+    const auto batch_del(std::chrono::duration<double, std::nano>(clock::now() - begin).count() / routes);
+
+    std::cout << "         ip route   one by one     batched   (ns per route)" << std::endl;
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << "add" << std::setw(14) << ip_add << std::setw(13) << single_add << std::setw(12) << batch_add << std::endl;
+    std::cout << "del" << std::setw(14) << ip_del << std::setw(13) << single_del << std::setw(12) << batch_del << std::endl;
+    std::cout << installed << " of " << routes << " routes seen in the dump" << std::endl;
+    return installed == routes ? 0 : 1;
+  }
+  catch (const nl::exception& e)
+  {
+    std::cout << "rtnetlink: " << e.what() << std::endl;
+    return 1;
+  }
+}
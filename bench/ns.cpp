@@ -0,0 +1,82 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../ns.hpp"
+
+/// Cost of entering and leaving a network namespace, as a handler
+/// hopping namespaces per request does: the previous ns::net, which opened
+/// both namespace files and unshared the mount namespace on every switch,
+/// against the registry with and without `ns::mount::unshare`. Then checks
+/// that a namespace deleted and added again under the same name is picked
+/// up. Needs root and `ip`, works on its own `customsh-bench` namespace.
+
+namespace
+{
+  using clock = std::chrono::steady_clock;
+
+  const int switches = 20000;
+
+  void legacy_switch(const char* path)
+  {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || setns(fd, CLONE_NEWNET) < 0 || unshare(CLONE_NEWNS) < 0)
+      std::exit(1);
+    close(fd);
+  }
+
+  void legacy()
+  {
+    legacy_switch("/run/netns/customsh-bench");
+    legacy_switch("/proc/1/ns/net");
+  }
+
+  template<typename F>
+  double run(F f)
+  {
+    const auto begin(clock::now());
+    for (int i(0); i < switches; ++ i)
+      f();
+    return std::chrono::duration<double, std::nano>(clock::now() - begin).count() / switches;
+  }
+
+  ino_t inode()
+  {
+    ns::net in("customsh-bench");
+    struct stat st;
+    return stat("/proc/thread-self/ns/net", &st) ? 0 : st.st_ino;
+  }
+}
+
+int main()
+{
+  if (std::system("ip netns add customsh-bench"))
+    return 1;
+  int status(0);
+  try
+  {
+    const auto keep(run([]() { ns::net in("customsh-bench"); }));
+    const auto unshared(run([]() { ns::net in("customsh-bench", ns::mount::unshare); }));
+    const auto before(run(legacy));
+    std::cout << "   previous    registry    unshare   (ns per switch)" << std::endl;
+    std::cout << std::fixed << std::setprecision(0) << std::setw(11) << before << std::setw(12) << keep << std::setw(11) << unshared << std::endl;
+
+    const auto first(inode());
+    if (std::system("ip netns del customsh-bench && ip netns add customsh-bench"))
+      status = 1;
+    usleep(100000);
+    std::cout << "namespace replaced: " << (inode() != first ? "picked up" : "stale fd used!") << std::endl;
+  }
+  catch (const ns::exception& e)
+  {
+    std::cout << "cannot switch: " << e.what() << std::endl;
+    status = 1;
+  }
+  if (std::system("ip netns del customsh-bench"))
+    status = 1;
+  return status;
+}
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <regex>
+#include "../pattern.hpp"
+
+/// customsh::pattern against std::regex_match on the argument patterns the
+/// handlers typically bind.
+
+namespace
+{
+  struct workload
+  {
+    const char* name;
+    const char* source;
+    std::vector<std::string> queries;
+  };
+
+  template<typename F>
+  double run(const std::vector<std::string>& queries, F matcher)
+  {
+    const std::size_t rounds(20000);
+    std::size_t hits(0);
+    auto start(std::chrono::steady_clock::now());
+    for (std::size_t r(0); r < rounds; ++ r)
+      for (auto& q : queries)
+        hits += matcher(q);
+    std::chrono::duration<double, std::nano> elapsed(std::chrono::steady_clock::now() - start);
+    if (hits == 42)
+      std::cerr << hits;
+    return elapsed.count() / (rounds * queries.size());
+  }
+}
+
+int main()
+{
+  std::vector<workload> workloads({
+    { "ipv4", "(\\d{1,3})\\.(\\d{1,3})\\.(\\d{1,3})\\.(\\d{1,3})", { "10.0.0.1", "192.168.100.254", "172.16.1", "8.8.8.8.8" } },
+    { "ipv4/prefix", "(\\d{1,3}(?:\\.\\d{1,3}){3})/(\\d{1,2})", { "10.0.0.0/8", "192.168.100.0/24", "10.1.1.1/" } },
+    { "interface", "((?:eth|wlan|bond|br|veth)\\d+)(?:\\.(\\d{1,4}))?", { "eth0", "bond1.100", "veth12345", "lo" } },
+    { "integer", "(-?\\d+)", { "0", "-42", "1500", "12a" } },
+    { "key value", "([a-z][a-z0-9_-]*)\\s+(on|off|\\d+)", { "mtu 1500", "promisc on", "multicast   off", "9 x" } },
+  });
+
+  std::cout << "ns per match" << std::endl;
+  std::cout << std::setw(12) << "pattern" << std::setw(12) << "std::regex" << std::setw(12) << "pattern" << std::endl;
+  for (auto& w : workloads)
+  {
+    const std::regex re(w.source);
+    const customsh::pattern compiled(w.source);
+    for (auto& q : w.queries)
+    {
+      std::smatch a;
+      customsh::match b;
+      if (std::regex_match(q, a, re) != compiled.matches(q, b) || a.size() != b.size())
+        throw std::exception();
+      for (std::size_t i(0); i < a.size(); ++ i)
+        if (a.str(i) != b.str(i))
+          throw std::exception();
+    }
+    auto x(run(w.queries, [&](const std::string& q) { std::smatch m; return std::regex_match(q, m, re); }));
+    auto y(run(w.queries, [&](const std::string& q) { customsh::match m; return compiled.matches(q, m); }));
+    std::cout << std::fixed << std::setprecision(1)
+      << std::setw(12) << w.name << std::setw(12) << x << std::setw(12) << y << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,133 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include "../queue.hpp"
+
+/// One producer standing in for the event loop, 1 to 64 workers. Reports
+/// hand-off throughput with the producer flooding the queue, and the p99
+/// latency from put() to get() returning with the producer paced.
+
+namespace
+{
+  using clock = std::chrono::steady_clock;
+
+  struct item
+  {
+    clock::time_point sent;
+  };
+
+  using item_ptr = std::shared_ptr<item>;
+
+  /// The previous request_queue, with the lock in put() actually held.
+  class locked_queue
+  {
+    std::mutex m_mutex;
+    std::queue<item_ptr> m_queue;
+    std::condition_variable m_not_empty;
+    bool m_closed = false;
+  public:
+    void put(item_ptr value)
+    {
+      std::unique_lock<std::mutex> locker(m_mutex);
+      m_queue.emplace(value);
+      m_not_empty.notify_one();
+    }
+    bool get(item_ptr& value)
+    {
+      std::unique_lock<std::mutex> locker(m_mutex);
+      while (!m_closed && m_queue.size() == 0)
+        m_not_empty.wait(locker);
+      if (m_queue.size() == 0)
+        return false;
+      value = m_queue.front();
+      m_queue.pop();
+      return true;
+    }
+    void close()
+    {
+      std::unique_lock<std::mutex> locker(m_mutex);
+      m_closed = true;
+      m_not_empty.notify_all();
+    }
+  };
+
+  struct result
+  {
+    double mops;
+    double p99;
+  };
+
+  template<typename Queue>
+  result run(unsigned workers, std::size_t count, std::chrono::nanoseconds pace)
+  {
+    Queue q;
+    std::vector<std::vector<double>> latencies(workers);
+    std::vector<std::thread> pool;
+    for (unsigned w(0); w < workers; ++ w)
+    {
+      latencies[w].reserve(count);
+      pool.emplace_back([&q, &latencies, w]()
+      {
+        item_ptr value;
+        while (q.get(value))
+        {
+          std::chrono::duration<double, std::micro> latency(clock::now() - value->sent);
+          latencies[w].emplace_back(latency.count());
+        }
+      });
+    }
+    auto start(clock::now());
+    for (std::size_t i(0); i < count; ++ i)
+    {
+      auto value(std::make_shared<item>());
+      if (pace.count())
+        while (clock::now() - start < pace * i);
+      value->sent = clock::now();
+      q.put(value);
+    }
+    while (true)
+    {
+      std::size_t done(0);
+      for (auto& l : latencies)
+        done += l.size();
+      if (done >= count)
+        break;
+      std::this_thread::yield();
+    }
+    std::chrono::duration<double, std::micro> elapsed(clock::now() - start);
+    q.close();
+    for (auto& t : pool)
+      t.join();
+    std::vector<double> all;
+    for (auto& l : latencies)
+      all.insert(all.end(), l.begin(), l.end());
+    std::nth_element(all.begin(), all.begin() + all.size() * 99 / 100, all.end());
+    return { count / elapsed.count(), all[all.size() * 99 / 100] };
+  }
+}
+
+int main()
+{
+  const std::size_t count(200000);
+  std::cout << "Mops/s flooding, p99 us with one put per 5us" << std::endl;
+  std::cout << std::setw(8) << "workers"
+    << std::setw(10) << "mutex" << std::setw(10) << "ring"
+    << std::setw(10) << "mutex" << std::setw(10) << "ring" << std::endl;
+  for (unsigned workers : { 1, 2, 4, 8, 16, 32, 64 })
+  {
+    auto a(run<locked_queue>(workers, count, std::chrono::nanoseconds(0)));
+    auto b(run<customsh::queue<item_ptr>>(workers, count, std::chrono::nanoseconds(0)));
+    auto c(run<locked_queue>(workers, count / 10, std::chrono::microseconds(5)));
+    auto d(run<customsh::queue<item_ptr>>(workers, count / 10, std::chrono::microseconds(5)));
+    std::cout << std::fixed << std::setprecision(2) << std::setw(8) << workers
+      << std::setw(10) << a.mops << std::setw(10) << b.mops
+      << std::setw(10) << c.p99 << std::setw(10) << d.p99 << std::endl;
+  }
+  return 0;
+}
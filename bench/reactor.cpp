@@ -0,0 +1,193 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/// A/B of the two event loops: starts the daemon once with epoll and once
+/// with `-u` (io_uring), drives both with the same request mix over N
+/// pipelined connections and reports requests per second and the p99 time
+/// for a whole pipelined batch. The daemon must be able to bind @custom_sh.
+///
+///   bench/reactor [DAEMON] [CONNECTIONS] [DEPTH] [SECONDS] [REACTORS]
+
+namespace
+{
+  using clock = std::chrono::steady_clock;
+
+  const char* const mix[] =
+  {
+    "show mtu eth0",
+    "show mtu eth0",
+    "show mtu eth0",
+    "set mtu eth0 1500",
+    "this is a prefix bench",
+    "no such command",
+  };
+
+  int connect_daemon()
+  {
+    auto fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path + 1, "custom_sh");
+    const socklen_t size(offsetof(sockaddr_un, sun_path) + 1 + std::strlen("custom_sh"));
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), size))
+    {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  bool read_all(int fd, char* data, std::size_t size)
+  {
+    while (size)
+    {
+      auto n(read(fd, data, size));
+      if (n <= 0)
+        return false;
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  /// Starts the daemon and returns its pid, found through the credentials
+  /// of a first connection since it forks itself away.
+  pid_t start(const std::string& daemon, const std::vector<std::string>& args)
+  {
+    auto child(fork());
+    if (!child)
+    {
+      std::vector<char*> argv;
+      argv.push_back(const_cast<char*>(daemon.c_str()));
+      for (auto& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+      argv.push_back(nullptr);
+      /* Keep the module tracing of the daemon out of the report. */
+      auto null(open("/dev/null", O_WRONLY));
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+      execv(daemon.c_str(), argv.data());
+      _exit(127);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    for (int i(0); i < 500; ++ i)
+    {
+      auto fd(connect_daemon());
+      if (fd >= 0)
+      {
+        ucred cred;
+        socklen_t size(sizeof(cred));
+        getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size);
+        close(fd);
+        return cred.pid;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return -1;
+  }
+
+  void stop(pid_t pid)
+  {
+    kill(pid, SIGTERM);
+    for (int i(0); i < 500 && kill(pid, 0) == 0; ++ i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  void run(const std::string& daemon, const std::vector<std::string>& args, const char* name, int connections, int depth, int seconds)
+  {
+    auto pid(start(daemon, args));
+    if (pid < 0)
+    {
+      std::cout << std::setw(8) << name << "  daemon did not come up" << std::endl;
+      return;
+    }
+
+    std::atomic<bool> go(true);
+    std::atomic<uint64_t> total(0);
+    std::vector<std::vector<double>> batches(connections);
+    std::vector<std::thread> clients;
+    for (int c(0); c < connections; ++ c)
+    {
+      clients.emplace_back([&, c]()
+      {
+        auto fd(connect_daemon());
+        if (fd < 0)
+          return;
+        std::string frames;
+        for (int i(0); i < depth; ++ i)
+        {
+          const char* cmd(mix[(c + i) % (sizeof(mix) / sizeof(*mix))]);
+          const uint32_t size(std::strlen(cmd));
+          frames.append(reinterpret_cast<const char*>(&size), sizeof(size));
+          frames.append(cmd, size);
+        }
+        std::vector<char> reply;
+        while (go)
+        {
+          const auto begin(clock::now());
+          if (write(fd, frames.data(), frames.size()) != ssize_t(frames.size()))
+            break;
+          for (int i(0); i < depth; ++ i)
+          {
+            uint32_t header[2];
+            if (!read_all(fd, reinterpret_cast<char*>(header), sizeof(header)))
+              goto out;
+            reply.resize(header[1]);
+            if (!read_all(fd, reply.data(), header[1]))
+              goto out;
+          }
+          batches[c].push_back(std::chrono::duration<double, std::micro>(clock::now() - begin).count());
+          total += depth;
+        }
+      out:
+        close(fd);
+      });
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    go = false;
+    std::for_each(clients.begin(), clients.end(), std::mem_fn(&std::thread::join));
+    stop(pid);
+
+    std::vector<double> all;
+    for (auto& b : batches)
+      all.insert(all.end(), b.begin(), b.end());
+    std::sort(all.begin(), all.end());
+    const double p99(all.empty() ? 0 : all[all.size() * 99 / 100]);
+    std::cout << std::setw(8) << name
+      << std::setw(12) << std::fixed << std::setprecision(0) << total / double(seconds) << " req/s"
+      << std::setw(10) << std::setprecision(1) << p99 << " us p99 batch" << std::endl;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const std::string daemon(argc > 1 ? argv[1] : "./customsh");
+  const int connections(argc > 2 ? std::atoi(argv[2]) : 16);
+  const int depth(argc > 3 ? std::atoi(argv[3]) : 16);
+  const int seconds(argc > 4 ? std::atoi(argv[4]) : 3);
+  const std::string reactors(argc > 5 ? argv[5] : "1");
+
+  signal(SIGPIPE, SIG_IGN);
+  std::cout << connections << " connections, " << depth << " pipelined, " << reactors << " reactor(s)" << std::endl;
+  run(daemon, { "-r", reactors }, "epoll", connections, depth, seconds);
+  run(daemon, { "-u", "-r", reactors }, "io_uring", connections, depth, seconds);
+  return 0;
+}
@@ -0,0 +1,109 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <system_error>
+#include <sys/resource.h>
+#include "../sh.hpp"
+
+/// Latency of running `/bin/true` through sh::sh at several RLIMIT_NOFILE
+/// values, against the previous vfork that closed every possible fd in the
+/// child one by one, and through the `spawner` helper. Limits above the
+/// hard limit are skipped unless run as root.
+
+namespace
+{
+  using clock = std::chrono::steady_clock;
+
+  const int spawns = 200;
+
+  /// The previous constructor, minus the streams.
+  void legacy()
+  {
+    int in[2], out[2], err[2];
+    if (::pipe(in) < 0 || ::pipe(out) < 0 || ::pipe(err) < 0)
+      throw std::exception();
+    auto pid(::vfork());
+    if (!pid)
+    {
+      const char* argv[] = { "/bin/true", nullptr };
+      ::dup2(in[0], STDIN_FILENO);
+      ::dup2(out[1], STDOUT_FILENO);
+      ::dup2(err[1], STDERR_FILENO);
+      for (auto i(sysconf(_SC_OPEN_MAX)); i >= 3; -- i)
+        ::close(i);
+      ::_exit(::execvp(argv[0], (char* const*)argv));
+    }
+    for (int fd : { in[0], in[1], out[0], out[1], err[0], err[1] })
+      ::close(fd);
+    int status;
+    ::waitpid(pid, &status, 0);
+  }
+
+  void current()
+  {
+    sh::sh sh("/bin/true");
+  }
+
+  template<typename F>
+  double run(F f)
+  {
+    const auto begin(clock::now());
+    for (int i(0); i < spawns; ++ i)
+      f();
+    return std::chrono::duration<double, std::micro>(clock::now() - begin).count() / spawns;
+  }
+}
+
+int main()
+{
+  try
+  {
+    sh::sh sh("/nonexistent/command");
+    std::cout << "exec failure not reported!" << std::endl;
+  }
+  catch (const std::system_error& e)
+  {
+    std::cout << "exec failure: " << e.what() << std::endl;
+  }
+
+  /* Direct spawns first, the helper stays in use once it runs. */
+  const rlim_t limits[] = { 1024, 16384, 65536, 1 << 20 };
+  double before[4], after[4], helped[4];
+  bool measured[4];
+  for (int pass(0); pass < 2; ++ pass)
+  {
+    for (int i(0); i < 4; ++ i)
+    {
+      rlimit limit;
+      ::getrlimit(RLIMIT_NOFILE, &limit);
+      limit.rlim_cur = limits[i];
+      limit.rlim_max = std::max(limit.rlim_max, limits[i]);
+      measured[i] = !::setrlimit(RLIMIT_NOFILE, &limit);
+      if (!measured[i])
+        continue;
+      if (pass)
+      {
+        helped[i] = run(current);
+      }
+      else
+      {
+        before[i] = run(legacy);
+        after[i] = run(current);
+      }
+    }
+    if (!pass && !sh::spawner::start())
+      helped[0] = helped[1] = helped[2] = helped[3] = 0;
+  }
+
+  std::cout << "    nofile    vfork+close   posix_spawn       spawner   (us per command)" << std::endl;
+  for (int i(0); i < 4; ++ i)
+  {
+    std::cout << std::setw(10) << limits[i];
+    if (measured[i])
+      std::cout << std::fixed << std::setprecision(1) << std::setw(15) << before[i] << std::setw(14) << after[i] << std::setw(14) << helped[i] << std::endl;
+    else
+      std::cout << "    skipped, cannot raise the limit" << std::endl;
+  }
+  return 0;
+}
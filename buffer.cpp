@@ -0,0 +1,147 @@
+#include <cstring>
+#include <algorithm>
+#include "buffer.hpp"
+
+namespace customsh
+{
+  namespace
+  {
+    /// Buffers kept per thread, and the largest one worth keeping.
+    const std::size_t pool_size = 16;
+    const std::size_t pool_capacity = 1 << 20;
+
+    struct pool
+    {
+      std::vector<buffer*> free;
+      ~pool()
+      {
+        for (auto b : free)
+          delete b;
+      }
+    };
+
+    thread_local pool local;
+  }
+
+  constexpr std::size_t buffer::header_size;
+  constexpr std::size_t buffer::tag_size;
+
+  void buffer_release::operator()(buffer* b) const
+  {
+    if (local.free.size() < pool_size && b->capacity() <= pool_capacity)
+      local.free.emplace_back(b);
+    else
+      delete b;
+  }
+
+  buffer_ptr buffer::get()
+  {
+    if (local.free.empty())
+      return buffer_ptr(new buffer());
+    buffer_ptr b(local.free.back());
+    local.free.pop_back();
+    b->reset();
+    return b;
+  }
+
+  void buffer::reset()
+  {
+    m_front = tag_size;
+    m_limit = 0;
+    m_spill = nullptr;
+    area(tag_size + header_size);
+  }
+
+  void buffer::seal(uint32_t status)
+  {
+    const uint32_t header[2] = { status, uint32_t(size() - header_size) };
+    std::memcpy(m_data.data() + m_front, header, sizeof(header));
+  }
+
+  void buffer::tag(uint32_t id)
+  {
+    uint32_t header[3];
+    std::memcpy(header, data(), header_size);
+    header[2] = id;
+    m_front = 0;
+    std::memcpy(m_data.data(), header, sizeof(header));
+  }
+
+  void buffer::stream(std::size_t limit, std::function<void(buffer_ptr)> spill)
+  {
+    m_limit = limit;
+    m_spill = std::move(spill);
+    area(pptr() - m_data.data());
+  }
+
+  void buffer::spill()
+  {
+    const std::size_t used(pptr() - m_data.data());
+    auto full(get());
+    full->m_data.swap(m_data);
+    full->m_front = m_front;
+    full->area(used);
+    m_front = tag_size;
+    area(tag_size + header_size);
+    m_spill(std::move(full));
+  }
+
+  void buffer::area(std::size_t used)
+  {
+    auto end(m_data.data() + m_data.size());
+    if (m_limit)
+      end = std::min(end, m_data.data() + m_front + header_size + m_limit);
+    setp(m_data.data(), end);
+    pbump(used);
+  }
+
+  void buffer::reserve(std::size_t more)
+  {
+    const std::size_t used(pptr() - m_data.data());
+    if (used + more <= m_data.size())
+      return;
+    auto capacity(m_data.size() * 2);
+    while (capacity < used + more)
+      capacity *= 2;
+    m_data.resize(capacity);
+    area(used);
+  }
+
+  buffer::int_type buffer::overflow(int_type c)
+  {
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+      return traits_type::not_eof(c);
+    if (m_limit && size() - header_size >= m_limit)
+      spill();
+    reserve(1);
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+  }
+
+  std::streamsize buffer::xsputn(const char* s, std::streamsize n)
+  {
+    if (m_limit)
+    {
+      for (std::streamsize done(0); done < n; )
+      {
+        const auto payload(size() - header_size);
+        if (payload >= m_limit)
+        {
+          spill();
+          continue;
+        }
+        const auto part(std::min<std::streamsize>(n - done, m_limit - payload));
+        reserve(part);
+        std::memcpy(pptr(), s + done, part);
+        pbump(part);
+        done += part;
+      }
+      return n;
+    }
+    reserve(n);
+    std::memcpy(pptr(), s, n);
+    pbump(n);
+    return n;
+  }
+}
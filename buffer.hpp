@@ -0,0 +1,71 @@
+#ifndef BUFFER_HPP
+#define BUFFER_HPP
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <streambuf>
+#include <functional>
+
+namespace customsh
+{
+  class buffer;
+
+  struct buffer_release
+  {
+    void operator()(buffer* b) const;
+  };
+
+  using buffer_ptr = std::unique_ptr<buffer, buffer_release>;
+
+  /// Reply frame under construction. Handlers write the payload through an
+  /// ostream straight into it, the `[ret][size]` header is reserved in front
+  /// so the finished frame goes out with a single send, with room for the
+  /// request id of protocol v2 before it. Buffers come from a small
+  /// per-thread pool and keep their capacity between requests.
+  class buffer : public std::streambuf
+  {
+    buffer(const buffer&) = delete;
+    buffer(const buffer&&) = delete;
+  public:
+    static constexpr std::size_t header_size = 2 * sizeof(uint32_t);
+
+    buffer() : m_data(4096) { reset(); }
+
+    static buffer_ptr get();
+
+    /// Drops the payload, the header stays reserved.
+    void reset();
+    /// Fills in the header for the payload written so far.
+    void seal(uint32_t status);
+    /// Turns a sealed frame into a v2 one, `[ret][size][id]`.
+    void tag(uint32_t id);
+    /// Hands the frame written so far to `spill` each time its payload
+    /// reaches `limit` bytes, and goes on in fresh storage: the payload of
+    /// a streamed reply never grows past `limit`. Until the next `reset()`.
+    void stream(std::size_t limit, std::function<void(buffer_ptr)> spill);
+
+    inline const char* data() const { return m_data.data() + m_front; }
+    inline std::size_t size() const { return pptr() - data(); }
+    inline std::size_t capacity() const { return m_data.size(); }
+
+  protected:
+    int_type overflow(int_type c);
+    std::streamsize xsputn(const char* s, std::streamsize n);
+
+  private:
+    static constexpr std::size_t tag_size = sizeof(uint32_t);
+    std::vector<char> m_data;
+    /* Where the frame starts, 0 once tagged. */
+    std::size_t m_front = tag_size;
+    std::size_t m_limit = 0;
+    std::function<void(buffer_ptr)> m_spill;
+    void reserve(std::size_t more);
+    void spill();
+    /// Sets the put area `used` bytes into the storage, ending at the
+    /// streaming limit when there is one.
+    void area(std::size_t used);
+  };
+}
+
+#endif
@@ -0,0 +1,140 @@
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include "customsh.hpp"
+#include "cache.hpp"
+
+namespace customsh
+{
+  namespace
+  {
+    const std::size_t shard_count = 16;
+    /* Bookkeeping charged per entry on top of its query and reply. */
+    const std::size_t entry_overhead = 128;
+
+    struct entry
+    {
+      std::string query;
+      std::string payload;
+      uint64_t generation;
+      std::chrono::steady_clock::time_point expiry;
+
+      inline std::size_t size() const { return query.size() + payload.size() + entry_overhead; }
+    };
+
+    struct shard
+    {
+      std::mutex mutex;
+      /* Most recently used first. */
+      std::list<entry> lru;
+      std::unordered_map<std::string, std::list<entry>::iterator> index;
+      std::size_t size = 0;
+
+      void erase(std::list<entry>::iterator i)
+      {
+        size -= i->size();
+        index.erase(i->query);
+        lru.erase(i);
+      }
+    };
+
+    shard s_shards[shard_count];
+    std::atomic<std::size_t> s_shard_capacity((16 << 20) / shard_count);
+    std::atomic<uint64_t> s_tickets(0);
+    thread_local const void* t_scope = nullptr;
+
+    inline shard& shard_of(const std::string& query)
+    {
+      return s_shards[std::hash<std::string>()(query) % shard_count];
+    }
+
+    /* The query behind the scope's address. */
+    inline std::string key(const void* scope, const std::string& query)
+    {
+      std::string k(reinterpret_cast<const char*>(&scope), sizeof(scope));
+      return k.append(query);
+    }
+
+    inline uint64_t generation(const d* object)
+    {
+      return object ? object->generation() : 0;
+    }
+  }
+
+  uint64_t cache::ticket()
+  {
+    return s_tickets.load(std::memory_order_acquire);
+  }
+
+  bool cache::get(const void* scope, const std::string& _query, const d* object, std::string& payload)
+  {
+    const auto query(key(scope, _query));
+    auto& s(shard_of(query));
+    std::lock_guard<std::mutex> locker(s.mutex);
+    auto i(s.index.find(query));
+    if (i == s.index.end())
+      return false;
+    auto e(i->second);
+    if (e->generation != generation(object) || e->expiry <= std::chrono::steady_clock::now())
+    {
+      s.erase(e);
+      return false;
+    }
+    s.lru.splice(s.lru.begin(), s.lru, e);
+    payload = e->payload;
+    return true;
+  }
+
+  void cache::put(const void* scope, const std::string& _query, const d* object, std::chrono::steady_clock::duration ttl, const char* payload, std::size_t payload_size, uint64_t ticket)
+  {
+    const auto query(key(scope, _query));
+    const auto capacity(s_shard_capacity.load(std::memory_order_relaxed));
+    if (query.size() + payload_size + entry_overhead > capacity)
+      return;
+    /* Read before the ticket, which invalidations bump first. */
+    const auto current(generation(object));
+    auto& s(shard_of(query));
+    std::lock_guard<std::mutex> locker(s.mutex);
+    /* Checked under the lock: an invalidation either came first or erases this entry after us. */
+    if (ticket != s_tickets.load(std::memory_order_acquire))
+      return;
+    auto i(s.index.find(query));
+    if (i != s.index.end())
+      s.erase(i->second);
+    s.lru.push_front(entry { query, std::string(payload, payload_size), current, std::chrono::steady_clock::now() + ttl });
+    s.index.emplace(query, s.lru.begin());
+    s.size += s.lru.front().size();
+    while (s.size > capacity)
+      s.erase(std::prev(s.lru.end()));
+  }
+
+  void cache::invalidate(const d* object)
+  {
+    /* Entries of the object go stale at once and are dropped when met. */
+    ++ s_tickets;
+    ++ object->m_generation;
+  }
+
+  void cache::invalidate(const std::string& _query)
+  {
+    const auto query(key(t_scope, _query));
+    auto& s(shard_of(query));
+    std::lock_guard<std::mutex> locker(s.mutex);
+    ++ s_tickets;
+    auto i(s.index.find(query));
+    if (i != s.index.end())
+      s.erase(i->second);
+  }
+
+  void cache::scope(const void* value)
+  {
+    t_scope = value;
+  }
+
+  void cache::capacity(std::size_t bytes)
+  {
+    s_shard_capacity = bytes / shard_count;
+  }
+}
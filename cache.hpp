@@ -0,0 +1,42 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+namespace customsh
+{
+  class d;
+
+  /// Replies of the bindings that asked for it, keyed by query, which also
+  /// determines the module, and by scope: the pool of workers answering, so
+  /// the same query in two network namespaces gets two entries, nullptr
+  /// being the default pool. An entry lives until its TTL runs out, its
+  /// object is invalidated or it is the least recently used one when the
+  /// cache is full. Split into shards, each with its own lock.
+  class cache
+  {
+  public:
+    /// Taken before calling the handler: invalidating anything in between
+    /// makes `put()` drop the reply, it may predate the change.
+    static uint64_t ticket();
+    /// Returns false on a miss, or when the entry has expired or its object
+    /// was invalidated since.
+    static bool get(const void* scope, const std::string& query, const d* object, std::string& payload);
+    static void put(const void* scope, const std::string& query, const d* object, std::chrono::steady_clock::duration ttl, const char* payload, std::size_t payload_size, uint64_t ticket);
+
+    /// Drops every reply of `object`'s bindings.
+    static void invalidate(const d* object);
+    /// Drops the reply to `query` in the calling thread's scope.
+    static void invalidate(const std::string& query);
+    /// Sets the calling thread's scope, the pool a worker belongs to.
+    static void scope(const void* value);
+
+    /// Bound on the queries and replies kept, 16 MiB by default.
+    static void capacity(std::size_t bytes);
+  };
+}
+
+#endif
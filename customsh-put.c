@@ -10,7 +10,7 @@
 
 static char buffer_cmd[4096];
 
-static int exec_customsh_cmd(const char* sun_path, const char* cmd, int cmd_len)
+static int open_customsh(const char* sun_path)
 {
   struct sockaddr_un addr;
   socklen_t addr_len;
@@ -27,15 +27,36 @@ static int exec_customsh_cmd(const char* sun_path, const char* cmd, int cmd_len)
   if (sock < 0)
   {
     perror("socket");
-    return 2;
+    return -2;
   }
 
   if (connect(sock, (struct sockaddr*)&addr, addr_len) == -1)
   {
     perror("connect");
-    return 3;
+    close(sock);
+    return -3;
   }
 
+  return sock;
+}
+
+static int recv_all(int sock, void* buff, int size)
+{
+  int done = 0;
+  while (done < size)
+  {
+    int recv_len = recv(sock, (char*)buff + done, size - done, 0);
+    if (recv_len <= 0)
+    {
+      return recv_len;
+    }
+    done += recv_len;
+  }
+  return done;
+}
+
+static int exec_customsh_cmd(int sock, const char* cmd, int cmd_len)
+{
   int recv_len = 0, ret = 0, buff_len = 0;
 
   if (send(sock, &cmd_len, sizeof(cmd_len), 0) == -1)
@@ -50,7 +71,7 @@ static int exec_customsh_cmd(const char* sun_path, const char* cmd, int cmd_len)
     return 4;
   }
 
-  recv_len = recv(sock, &ret, sizeof(ret), 0);
+  recv_len = recv_all(sock, &ret, sizeof(ret));
   if (recv_len < 0)
   {
     perror("recv");
@@ -61,13 +82,8 @@ static int exec_customsh_cmd(const char* sun_path, const char* cmd, int cmd_len)
     printf("Server closed connection\n");
     return 6;
   }
-  else if (recv_len < 4)
-  {
-    perror("package error");
-    return 5;
-  }
 
-  recv_len = recv(sock, &buff_len, sizeof(buff_len), 0);
+  recv_len = recv_all(sock, &buff_len, sizeof(buff_len));
   if (recv_len < 0)
   {
     perror("recv");
@@ -78,29 +94,118 @@ static int exec_customsh_cmd(const char* sun_path, const char* cmd, int cmd_len)
     printf("Server closed connection\n");
     return 6;
   }
-  else if (recv_len < 4)
-  {
-    printf("package error");
-    return 5;
-  }
 
   char* buff = (char*)malloc(buff_len + 1);
   if (buff != NULL)
   {
-    recv(sock, buff, buff_len, 0);
-    printf("ret(%d)>\n%*s\n", ret, buff_len, buff);
+    recv_len = recv_all(sock, buff, buff_len);
+    if (recv_len < buff_len)
+    {
+      free(buff);
+      printf("package error\n");
+      return 5;
+    }
+    printf("ret(%d)>\n%.*s\n", ret, buff_len, buff);
     free(buff);
   }
 
-  close(sock);
-
   return ret;
 }
 
+/* Set in the length of a frame carrying several commands. */
+#define MULTI_FRAME 0x80000000u
+
+/* Sends every line of stdin in one multi-command frame and prints the
+   replies in order. */
+static int exec_customsh_multi(int sock)
+{
+  char* frame = NULL;
+  uint32_t frame_len = 0, frame_size = 0;
+  while (fgets(buffer_cmd, sizeof(buffer_cmd) - 1, stdin) != NULL)
+  {
+    uint32_t cmd_len = strlen(buffer_cmd);
+    while (cmd_len > 0 && buffer_cmd[cmd_len - 1] == '\n')
+    {
+      -- cmd_len;
+    }
+    if (frame_len + sizeof(cmd_len) + cmd_len > frame_size)
+    {
+      frame_size = 2 * (frame_len + sizeof(cmd_len) + cmd_len);
+      char* bigger = (char*)realloc(frame, frame_size);
+      if (bigger == NULL)
+      {
+        free(frame);
+        perror("realloc");
+        return 4;
+      }
+      frame = bigger;
+    }
+    memcpy(frame + frame_len, &cmd_len, sizeof(cmd_len));
+    memcpy(frame + frame_len + sizeof(cmd_len), buffer_cmd, cmd_len);
+    frame_len += sizeof(cmd_len) + cmd_len;
+  }
+
+  uint32_t header = frame_len | MULTI_FRAME;
+  if (send(sock, &header, sizeof(header), 0) == -1 || (frame_len > 0 && send(sock, frame, frame_len, 0) == -1))
+  {
+    free(frame);
+    perror("send");
+    return 4;
+  }
+  free(frame);
+
+  uint32_t reply[2];
+  int recv_len = recv_all(sock, reply, sizeof(reply));
+  if (recv_len <= 0)
+  {
+    printf("Server closed connection\n");
+    return 6;
+  }
+  char* buff = (char*)malloc(reply[1] + 1);
+  if (buff == NULL || recv_all(sock, buff, reply[1]) < (int)reply[1])
+  {
+    free(buff);
+    printf("package error\n");
+    return 5;
+  }
+  for (uint32_t offset = 0; offset + sizeof(reply) <= reply[1]; )
+  {
+    uint32_t record[2];
+    memcpy(record, buff + offset, sizeof(record));
+    offset += sizeof(record);
+    if (record[1] > reply[1] - offset)
+    {
+      break;
+    }
+    printf("ret(%d)>\n%.*s\n", record[0], (int)record[1], buff + offset);
+    offset += record[1];
+  }
+  free(buff);
+  return reply[0];
+}
+
 int main(int argc, char** argv)
 {
-  if (argc == 2)
+  if (argc == 3 && strcmp(argv[1], "-m") == 0)
+  {
+    /* All of stdin in one round trip, the commands may run concurrently. */
+    int sock = open_customsh(argv[2]);
+    if (sock < 0)
+    {
+      return -sock;
+    }
+    int ret = exec_customsh_multi(sock);
+    close(sock);
+    return ret;
+  }
+  else if (argc == 2)
   {
+    /* One connection for the whole session, commands are answered in order. */
+    int sock = open_customsh(argv[1]);
+    if (sock < 0)
+    {
+      return -sock;
+    }
     while (feof(stdin) == 0)
     {
       char* cmd = fgets(buffer_cmd, sizeof(buffer_cmd) - 1, stdin);
@@ -116,15 +221,26 @@ int main(int argc, char** argv)
       }
       cmd[cmd_len] = 0;
 
-      exec_customsh_cmd(argv[1], cmd, cmd_len);
+      if (exec_customsh_cmd(sock, cmd, cmd_len) > 4)
+      {
+        break;
+      }
     }
+    close(sock);
     return 0;
   }
   else if (argc == 3)
   {
-    return exec_customsh_cmd(argv[1], argv[2], strlen(argv[2]));
+    int sock = open_customsh(argv[1]);
+    if (sock < 0)
+    {
+      return -sock;
+    }
+    int ret = exec_customsh_cmd(sock, argv[2], strlen(argv[2]));
+    close(sock);
+    return ret;
   }
-  fprintf(stderr, "Using: %s UNIX_SOCKET [CMD]\n", argv[0]);
+  fprintf(stderr, "Using: %s UNIX_SOCKET [CMD]\n       %s -m UNIX_SOCKET < COMMANDS\n", argv[0], argv[0]);
   return 1;
 }
 
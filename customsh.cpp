@@ -1,19 +1,16 @@
 #include <iostream>
 #include <limits>
+#include <cstring>
+#include <algorithm>
 #include "customsh.hpp"
 
 namespace customsh
 {
   std::vector<module_ptr> modules::list;
   std::vector<module_ptr>::size_type modules::min_prefix_size(std::numeric_limits<std::vector<module_ptr>::size_type>::max());
-
-  static int module_compare(module_ptr a, const std::string& query)
-  {
-    const auto n(std::memcmp(a->prefix, query.c_str(), std::min(a->prefix_size - 1, query.size())));
-    if (n < 0) return -1;
-    if (n > 0) return  1;
-    return 0;
-  }
+  std::vector<modules::node> modules::nodes;
+  std::vector<unsigned char> modules::keys;
+  std::string modules::labels;
 
   static bool module_compare_less(module_ptr a, module_ptr b)
   {
@@ -21,9 +18,21 @@ namespace customsh
     return n ? n < 0 : a->prefix_size < b->prefix_size;
   }
 
-  static bool module_compare_not_equal(module_ptr a, const std::string& query)
+  static thread_local const std::function<deferred_ptr()>* deferrer(nullptr);
+
+  deferred_ptr defer()
   {
-    return !!std::memcmp(a->prefix, query.c_str(), std::min(a->prefix_size - 1, query.size()));
+    return deferrer ? (*deferrer)() : nullptr;
+  }
+
+  deferring::deferring(const std::function<deferred_ptr()>& factory)
+  {
+    deferrer = &factory;
+  }
+
+  deferring::~deferring()
+  {
+    deferrer = nullptr;
   }
 
   void modules::push(module_ptr mod)
@@ -31,50 +40,140 @@ namespace customsh
     list.emplace_back(mod);
   }
 
+  /// Fills node `index` from `list[begin, end)`, all of which share their
+  /// first `depth` characters. Children of a node are stored contiguously and
+  /// ordered by their first character, which is mirrored in `keys`.
+  void modules::build(uint32_t index, std::size_t begin, std::size_t end, std::size_t depth)
+  {
+    while (begin < end && list[begin]->prefix_size - 1 == depth)
+    {
+      nodes[index].value = list[begin].get();
+      ++ begin;
+    }
+    std::vector<std::pair<std::size_t, std::size_t>> groups;
+    for (auto i(begin); i < end; )
+    {
+      auto j(i + 1);
+      while (j < end && list[j]->prefix[depth] == list[i]->prefix[depth])
+        ++ j;
+      groups.emplace_back(i, j);
+      i = j;
+    }
+    nodes[index].child = nodes.size();
+    nodes[index].child_count = groups.size();
+    nodes.resize(nodes.size() + groups.size());
+    keys.resize(nodes.size());
+    for (std::size_t g(0); g < groups.size(); ++ g)
+    {
+      const auto first(list[groups[g].first]);
+      const auto last(list[groups[g].second - 1]);
+      auto lcp(depth + 1);
+      while (lcp < first->prefix_size - 1 && first->prefix[lcp] == last->prefix[lcp])
+        ++ lcp;
+      const auto child(nodes[index].child + g);
+      nodes[child].label = labels.size();
+      nodes[child].label_size = lcp - depth;
+      keys[child] = first->prefix[depth];
+      labels.append(first->prefix + depth, lcp - depth);
+      build(child, groups[g].first, groups[g].second, lcp);
+    }
+  }
+
   void modules::init()
   {
-    std::sort(list.begin(), list.end(), module_compare_less);
+    std::stable_sort(list.begin(), list.end(), module_compare_less);
     for (auto i : list)
       if (min_prefix_size > i->prefix_size)
         min_prefix_size = i->prefix_size;
     -- min_prefix_size;
+    nodes.assign(1, node());
+    keys.assign(1, 0);
+    labels.clear();
+    build(0, 0, list.size(), 0);
   }
 
-  module_ptr modules::get(const std::string& query)
+  module* modules::get(const char* query, std::size_t query_size)
   {
-    if (min_prefix_size > query.size())
+    if (min_prefix_size > query_size)
       throw not_found();
-    std::vector<module_ptr>::size_type l(0);
-    std::vector<module_ptr>::size_type r(list.size());
+    module* found(nullptr);
+    const node* n(nodes.data());
+    std::size_t pos(0);
     while (true)
     {
-      auto i((l + r) / 2);
-      auto m(list[i]);
-      auto n(module_compare(m, query));
-      if (n == 0)
-      {
-        for (++ i; i < list.size(); ++ i)
-        {
-          auto k(list[i]);
-          if (module_compare_not_equal(k, query))
-            break;
-          m = k;
-        }
-        return m;
-      }
-      else if (i == l)
-      {
-        throw not_found();
-      }
-      else if (n < 0)
+      if (n->value)
+        found = n->value;
+      if (pos == query_size || !n->child_count)
+        break;
+      const auto first(keys.data() + n->child);
+      const auto last(first + n->child_count);
+      const auto key(std::lower_bound(first, last, (unsigned char)query[pos]));
+      if (key == last || *key != (unsigned char)query[pos])
+        break;
+      const auto& child(nodes[key - keys.data()]);
+      if (child.label_size > query_size - pos || std::memcmp(labels.data() + child.label, query + pos, child.label_size))
+        break;
+      pos += child.label_size;
+      n = &child;
+    }
+    if (!found)
+      throw not_found();
+    return found;
+  }
+
+  bool d::grantable(access mode) const
+  {
+    if (m_writer || m_waiting.size())
+      return false;
+    return mode == access::shared || !m_readers;
+  }
+
+  bool d::acquire(job_ptr j, access mode)
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    if (!grantable(mode))
+    {
+      m_waiting.push_back({ j, mode });
+      return false;
+    }
+    if (mode == access::shared)
+      ++ m_readers;
+    else
+      m_writer = true;
+    return true;
+  }
+
+  bool d::park(job_ptr j, access mode)
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    if (grantable(mode))
+      return false;
+    m_waiting.push_back({ j, mode });
+    return true;
+  }
+
+  void d::release(access mode, std::vector<job_ptr>& handed)
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    if (mode == access::shared)
+      -- m_readers;
+    else
+      m_writer = false;
+    while (m_waiting.size() && !m_writer)
+    {
+      auto& next(m_waiting.front());
+      if (next.mode == access::exclusive)
       {
-        r = i;
+        if (m_readers)
+          break;
+        m_writer = true;
       }
-      else if (n > 0)
+      else
       {
-        l = i + 1;
+        ++ m_readers;
       }
+      handed.emplace_back(next.job);
+      m_waiting.pop_front();
     }
   }
 }
-
@@ -4,15 +4,25 @@
 #include <set>
 #include <map>
 #include <list>
+#include <deque>
 #include <vector>
 #include <string>
-#include <regex>
 #include <mutex>
 #include <memory>
 #include <exception>
 #include <ostream>
+#include <iostream>
 #include <sstream>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+#include "pattern.hpp"
+#include "logger.hpp"
+#include "task.hpp"
+#include "cache.hpp"
 
 namespace customsh
 {
@@ -22,18 +32,83 @@ namespace customsh
     bad_argument() { }
   };
 
-  class locked : public std::exception
+  class not_found : public std::exception
   {
   public:
-    locked() { }
+    not_found() { }
   };
 
-  class not_found : public std::exception
+  class d;
+
+  /// How a handler uses its object: shared handlers only read it and run
+  /// concurrently, exclusive ones run alone.
+  enum class access
+  {
+    shared,
+    exclusive,
+  };
+
+  /// Something that can be parked on a busy `d` object, see `d::acquire()`.
+  class job
   {
   public:
-    not_found() { }
+    virtual ~job() { }
+  };
+
+  using job_ptr = std::shared_ptr<job>;
+
+  /// A reply sent after its handler returned, see `defer()`.
+  class deferred
+  {
+  public:
+    virtual ~deferred() { }
+    virtual void send(const std::string& payload) = 0;
+    /// Answers as if the handler had thrown `error`.
+    virtual void fail(const std::exception& error) = 0;
+  };
+
+  using deferred_ptr = std::shared_ptr<deferred>;
+
+  /// For a handler that answers later, typically from the completion of a
+  /// `sh::async` command: what it wrote to `cout` is dropped and the request
+  /// is answered through the returned handle instead. The connection's next
+  /// request waits for it, a handle released unanswered fails the request.
+  /// An exclusive binding keeps its object until then, a shared one gives
+  /// it up when the handler returns. Returns nullptr outside of a handler.
+  deferred_ptr defer();
+
+  /// Makes `defer()` work on this thread while it lives, set up by the event
+  /// loop around each call.
+  class deferring
+  {
+    deferring(const deferring&) = delete;
+  public:
+    deferring(const std::function<deferred_ptr()>& factory);
+    ~deferring();
   };
 
+  /// How replies of a shared binding may be reused, see `d::bind_shared`.
+  struct reply_policy
+  {
+    /// How long replies stay in the `cache`, not cached when zero.
+    std::chrono::steady_clock::duration ttl {};
+    /// Identical queries arriving while one runs get its reply instead of
+    /// running again.
+    bool coalesce = false;
+  };
+
+  /// How a batch binding gathers queued requests, see `d::bind_batch`.
+  struct batch_policy
+  {
+    /// Most requests handed over in one call.
+    std::size_t max = 64;
+    /// How long the first request waits for more before the call, on top
+    /// of those already queued.
+    std::chrono::steady_clock::duration linger {};
+  };
+
+  class batch_module;
+
   class module
   {
     module(const module&) = delete;
@@ -41,93 +116,189 @@ namespace customsh
   public:
     const char* prefix;
     const std::size_t prefix_size;
-    constexpr module(const char* _prefix, std::size_t _prefix_size) : prefix(_prefix), prefix_size(_prefix_size) { }
+    const access mode;
+    reply_policy policy;
+    constexpr module(const char* _prefix, std::size_t _prefix_size, access _mode = access::exclusive) : prefix(_prefix), prefix_size(_prefix_size), mode(_mode) { }
+    /// The object a call has to own first, nullptr for unsafe bindings.
+    virtual d* object() { return nullptr; }
     virtual void call(const std::string& query, std::ostream& cout) = 0;
+    /// Itself for batch bindings, nullptr otherwise.
+    virtual batch_module* batch() { return nullptr; }
   };
 
   using module_ptr = std::shared_ptr<module>;
 
+  /// Registry of all bound prefixes. `init()` compiles it into a radix tree
+  /// kept in flat arrays, lookups never touch the `module_ptr` refcounts.
   class modules
   {
+    struct node
+    {
+      uint32_t label = 0;
+      uint32_t label_size = 0;
+      uint32_t child = 0;
+      uint32_t child_count = 0;
+      module* value = nullptr;
+    };
     static std::vector<module_ptr> list;
     static std::vector<module_ptr>::size_type min_prefix_size;
+    static std::vector<node> nodes;
+    static std::vector<unsigned char> keys;
+    static std::string labels;
+    static void build(uint32_t index, std::size_t begin, std::size_t end, std::size_t depth);
   public:
     static void push(module_ptr mod);
     static void init();
-    static module_ptr get(const std::string& query);
+    static module* get(const char* query, std::size_t query_size);
+    static inline module* get(const std::string& query) { return get(query.data(), query.size()); }
   };
 
   struct args
   {
     std::string prefix;
     std::string query;
-    std::smatch args;
+    match args;
   };
 
   template<typename Object>
   using member_ptr = void (Object::*)(const args&, std::ostream&);
 
+  /// One request of a batch: what a `member_ptr` handler gets for it.
+  /// Setting `failed` answers it alone as if its handler had thrown, what
+  /// was written to its `cout` is dropped then.
+  struct batched
+  {
+    customsh::args args;
+    std::ostream& cout;
+    std::exception_ptr failed;
+  };
+
+  /// A batch handler answers every request in `items`, in one go.
+  template<typename Object>
+  using batch_member_ptr = void (Object::*)(std::vector<batched>& items);
+
+  /// What the event loop needs from a batch binding: the queries are parsed
+  /// one by one, then handed over together. Called alone, it answers a
+  /// batch of one.
+  class batch_module : public module
+  {
+  public:
+    batch_policy batching;
+    constexpr batch_module(const char* _prefix, std::size_t _prefix_size) : module(_prefix, _prefix_size, access::exclusive) { }
+    batch_module* batch() { return this; }
+    /// Fills `a` for `query`, throws `bad_argument` when it does not match.
+    /// `a` must stay where it is afterwards, its submatches point into it.
+    virtual void parse(const std::string& query, args& a) = 0;
+    virtual void call(std::vector<batched>& items) = 0;
+
+    void call(const std::string& query, std::ostream& cout)
+    {
+      std::vector<batched> items;
+      items.push_back({ args(), cout, nullptr });
+      parse(query, items.back().args);
+      call(items);
+      if (items.back().failed)
+        std::rethrow_exception(items.back().failed);
+    }
+  };
+
+  /// A coroutine handler: it answers with what it `co_return`s and its
+  /// arguments stay valid until then. It runs on the worker until it first
+  /// suspends, the rest runs wherever it is resumed. Bound with `bind()`,
+  /// it owns its object until it `co_return`s, so it must not `call()` a
+  /// query of that object; with `bind_shared()`, only until it first
+  /// suspends. See await.hpp for what it can wait for.
+  template<typename Object>
+  using co_member_ptr = task<std::string> (Object::*)(const args&);
+
+  namespace detail
+  {
+    inline detached reply(task<std::string> handler, deferred_ptr later, std::shared_ptr<args>)
+    {
+      try
+      {
+        later->send(co_await std::move(handler));
+      }
+      catch (const std::exception& e)
+      {
+        later->fail(e);
+      }
+    }
+  }
+
+  template<typename Object>
+  inline void invoke(Object* object, member_ptr<Object> member, const args& a, std::ostream& cout)
+  {
+    (object->*member)(a, cout);
+  }
+
   template<typename Object>
+  inline void invoke(Object* object, co_member_ptr<Object> member, const args& a, std::ostream&)
+  {
+    auto kept(std::make_shared<args>(a));
+    kept->args.rebase(a.query.data(), kept->query.data());
+    detail::reply((object->*member)(*kept), defer(), kept);
+  }
+
+  template<typename Object, typename Member = member_ptr<Object>>
   class _module : public module
   {
     Object* m_object = nullptr;
-    const member_ptr<Object> m_member = nullptr;
+    const Member m_member = nullptr;
   public:
-    constexpr _module(const char* _prefix, std::size_t _prefix_size, Object* _object, member_ptr<Object> _member)
-      : module(_prefix, _prefix_size)
+    constexpr _module(const char* _prefix, std::size_t _prefix_size, Object* _object, Member _member, access _mode)
+      : module(_prefix, _prefix_size, _mode)
       , m_object(_object)
       , m_member(_member)
     {
     }
 
+    d* object() { return m_object; }
+
     void call(const std::string& query, std::ostream& cout)
     {
-      if (!m_object->lock())
-        throw locked();
       args a;
       a.prefix = prefix;
       a.query = query;
-      (m_object->*m_member)(a, cout);
-      m_object->unlock();
+      customsh::invoke(m_object, m_member, a, cout);
     }
   };
 
-  template<typename Object>
+  template<typename Object, typename Member = member_ptr<Object>>
   class _module_regex : public module
   {
-    const std::regex m_regex;
+    const pattern m_pattern;
     Object* m_object = nullptr;
-    const member_ptr<Object> m_member = nullptr;
+    const Member m_member = nullptr;
   public:
-    constexpr _module_regex(const char* _prefix, std::size_t _prefix_size, const char* _regex, std::size_t _regex_size, Object* _object, member_ptr<Object> _member)
-      : module(_prefix, _prefix_size)
-      , m_regex(_regex, _regex_size)
+    constexpr _module_regex(const char* _prefix, std::size_t _prefix_size, const char* _regex, std::size_t _regex_size, Object* _object, Member _member, access _mode)
+      : module(_prefix, _prefix_size, _mode)
+      , m_pattern(_regex, _regex_size - 1)
       , m_object(_object)
       , m_member(_member)
     {
     }
 
+    d* object() { return m_object; }
+
     void call(const std::string& query, std::ostream& cout)
     {
       args a;
-      if (!m_object->lock())
-        throw locked();
-      if (!std::regex_match(query, a.args, m_regex))
+      a.query = query;
+      if (!m_pattern.matches(a.query, a.args))
         throw bad_argument();
       a.prefix = prefix;
-      a.query = query;
-      (m_object->*m_member)(a, cout);
-      m_object->unlock();
+      customsh::invoke(m_object, m_member, a, cout);
     }
   };
 
-  template<typename Object>
+  template<typename Object, typename Member = member_ptr<Object>>
   class _module_unsafe : public module
   {
     Object* m_object = nullptr;
-    const member_ptr<Object> m_member = nullptr;
+    const Member m_member = nullptr;
   public:
-    constexpr _module_unsafe(const char* _prefix, std::size_t _prefix_size, Object* _object, member_ptr<Object> _member)
+    constexpr _module_unsafe(const char* _prefix, std::size_t _prefix_size, Object* _object, Member _member)
       : module(_prefix, _prefix_size)
       , m_object(_object)
       , m_member(_member)
@@ -139,20 +310,20 @@ namespace customsh
       args a;
       a.prefix = prefix;
       a.query = query;
-      (m_object->*m_member)(a, cout);
+      customsh::invoke(m_object, m_member, a, cout);
     }
   };
 
-  template<typename Object>
+  template<typename Object, typename Member = member_ptr<Object>>
   class _module_regex_unsafe : public module
   {
-    const std::regex m_regex;
+    const pattern m_pattern;
     Object* m_object = nullptr;
-    const member_ptr<Object> m_member = nullptr;
+    const Member m_member = nullptr;
   public:
-    constexpr _module_regex_unsafe(const char* _prefix, std::size_t _prefix_size, const char* _regex, std::size_t _regex_size, Object* _object, member_ptr<Object> _member)
+    constexpr _module_regex_unsafe(const char* _prefix, std::size_t _prefix_size, const char* _regex, std::size_t _regex_size, Object* _object, Member _member)
       : module(_prefix, _prefix_size)
-      , m_regex(_regex, _regex_size)
+      , m_pattern(_regex, _regex_size - 1)
       , m_object(_object)
       , m_member(_member)
     {
@@ -161,11 +332,71 @@ namespace customsh
     void call(const std::string& query, std::ostream& cout)
     {
       args a;
-      if (!std::regex_match(query, a.args, m_regex))
+      a.query = query;
+      if (!m_pattern.matches(a.query, a.args))
         throw bad_argument();
       a.prefix = prefix;
+      customsh::invoke(m_object, m_member, a, cout);
+    }
+  };
+
+  template<typename Object>
+  class _module_batch : public batch_module
+  {
+    Object* m_object = nullptr;
+    const batch_member_ptr<Object> m_member = nullptr;
+  public:
+    constexpr _module_batch(const char* _prefix, std::size_t _prefix_size, Object* _object, batch_member_ptr<Object> _member)
+      : batch_module(_prefix, _prefix_size)
+      , m_object(_object)
+      , m_member(_member)
+    {
+    }
+
+    d* object() { return m_object; }
+
+    void parse(const std::string& query, args& a)
+    {
+      a.prefix = prefix;
+      a.query = query;
+    }
+
+    using batch_module::call;
+    void call(std::vector<batched>& items)
+    {
+      (m_object->*m_member)(items);
+    }
+  };
+
+  template<typename Object>
+  class _module_regex_batch : public batch_module
+  {
+    const pattern m_pattern;
+    Object* m_object = nullptr;
+    const batch_member_ptr<Object> m_member = nullptr;
+  public:
+    constexpr _module_regex_batch(const char* _prefix, std::size_t _prefix_size, const char* _regex, std::size_t _regex_size, Object* _object, batch_member_ptr<Object> _member)
+      : batch_module(_prefix, _prefix_size)
+      , m_pattern(_regex, _regex_size - 1)
+      , m_object(_object)
+      , m_member(_member)
+    {
+    }
+
+    d* object() { return m_object; }
+
+    void parse(const std::string& query, args& a)
+    {
       a.query = query;
-      (m_object->*m_member)(a, cout);
+      if (!m_pattern.matches(a.query, a.args))
+        throw bad_argument();
+      a.prefix = prefix;
+    }
+
+    using batch_module::call;
+    void call(std::vector<batched>& items)
+    {
+      (m_object->*m_member)(items);
     }
   };
 
@@ -173,23 +404,126 @@ namespace customsh
   {
     d(const d&) = delete;
     d(const d&&) = delete;
-    std::mutex m_lock;
+    struct waiting
+    {
+      job_ptr job;
+      access mode;
+    };
+    std::mutex m_mutex;
+    std::size_t m_readers = 0;
+    bool m_writer = false;
+    std::deque<waiting> m_waiting;
+    /* Bumped by `invalidate()`, replies cached before are stale. */
+    mutable std::atomic<uint64_t> m_generation { 0 };
+    bool grantable(access mode) const;
+    friend class cache;
   public:
-    constexpr d() { }
-    inline bool lock() { return m_lock.try_lock(); }
-    inline void unlock() { m_lock.unlock(); }
+    d() { }
+    inline uint64_t generation() const { return m_generation.load(std::memory_order_acquire); }
+    /// Takes the object for `j`. When that is not possible yet `j` is parked
+    /// in FIFO order and false is returned; it is handed over later by
+    /// `release()`. Shared jobs only wait for a writer, but also queue up
+    /// behind a parked writer so readers cannot starve it.
+    bool acquire(job_ptr j, access mode);
+    /// Parks `j` only if it would have to wait, without taking the object
+    /// otherwise.
+    bool park(job_ptr j, access mode);
+    /// Gives the object up and appends the parked jobs that own it from now
+    /// on to `handed`, in FIFO order: one writer or a run of readers. They
+    /// have to be run by the caller.
+    void release(access mode, std::vector<job_ptr>& handed);
   protected:
+    /// To be called when the state behind cached replies changes: drops all
+    /// of this object's, or the one to `query` in the calling worker's pool,
+    /// `query` being what the handler sees, without an `@netns ` tag.
+    inline void invalidate() { cache::invalidate(this); }
+    inline void invalidate(const std::string& query) { cache::invalidate(query); }
 
     template<std::size_t prefix_size, typename Object>
     inline void bind(const char (&prefix)[prefix_size], member_ptr<Object> _member)
     {
-      modules::push(std::make_shared<_module<Object>>(prefix, prefix_size, static_cast<Object*>(this), _member));
+      modules::push(std::make_shared<_module<Object>>(prefix, prefix_size, static_cast<Object*>(this), _member, access::exclusive));
     }
 
     template<std::size_t prefix_size, std::size_t regex_size, typename Object>
     inline void bind(const char (&prefix)[prefix_size], const char (&regex)[regex_size], member_ptr<Object> _member)
     {
-      modules::push(std::make_shared<_module_regex<Object>>(prefix, prefix_size, regex, regex_size, static_cast<Object*>(this), _member));
+      modules::push(std::make_shared<_module_regex<Object>>(prefix, prefix_size, regex, regex_size, static_cast<Object*>(this), _member, access::exclusive));
+    }
+
+    template<std::size_t prefix_size, typename Object>
+    inline void bind_exclusive(const char (&prefix)[prefix_size], member_ptr<Object> _member)
+    {
+      bind(prefix, _member);
+    }
+
+    template<std::size_t prefix_size, std::size_t regex_size, typename Object>
+    inline void bind_exclusive(const char (&prefix)[prefix_size], const char (&regex)[regex_size], member_ptr<Object> _member)
+    {
+      bind(prefix, regex, _member);
+    }
+
+    template<std::size_t prefix_size, typename Object>
+    inline void bind_shared(const char (&prefix)[prefix_size], member_ptr<Object> _member, const reply_policy& policy = {})
+    {
+      auto mod(std::make_shared<_module<Object>>(prefix, prefix_size, static_cast<Object*>(this), _member, access::shared));
+      mod->policy = policy;
+      modules::push(mod);
+    }
+
+    template<std::size_t prefix_size, std::size_t regex_size, typename Object>
+    inline void bind_shared(const char (&prefix)[prefix_size], const char (&regex)[regex_size], member_ptr<Object> _member, const reply_policy& policy = {})
+    {
+      auto mod(std::make_shared<_module_regex<Object>>(prefix, prefix_size, regex, regex_size, static_cast<Object*>(this), _member, access::shared));
+      mod->policy = policy;
+      modules::push(mod);
+    }
+
+    template<std::size_t prefix_size, typename Object>
+    inline void bind(const char (&prefix)[prefix_size], co_member_ptr<Object> _member)
+    {
+      modules::push(std::make_shared<_module<Object, co_member_ptr<Object>>>(prefix, prefix_size, static_cast<Object*>(this), _member, access::exclusive));
+    }
+
+    template<std::size_t prefix_size, std::size_t regex_size, typename Object>
+    inline void bind(const char (&prefix)[prefix_size], const char (&regex)[regex_size], co_member_ptr<Object> _member)
+    {
+      modules::push(std::make_shared<_module_regex<Object, co_member_ptr<Object>>>(prefix, prefix_size, regex, regex_size, static_cast<Object*>(this), _member, access::exclusive));
+    }
+
+    template<std::size_t prefix_size, typename Object>
+    inline void bind_shared(const char (&prefix)[prefix_size], co_member_ptr<Object> _member, const reply_policy& policy = {})
+    {
+      auto mod(std::make_shared<_module<Object, co_member_ptr<Object>>>(prefix, prefix_size, static_cast<Object*>(this), _member, access::shared));
+      mod->policy = policy;
+      modules::push(mod);
+    }
+
+    template<std::size_t prefix_size, std::size_t regex_size, typename Object>
+    inline void bind_shared(const char (&prefix)[prefix_size], const char (&regex)[regex_size], co_member_ptr<Object> _member, const reply_policy& policy = {})
+    {
+      auto mod(std::make_shared<_module_regex<Object, co_member_ptr<Object>>>(prefix, prefix_size, regex, regex_size, static_cast<Object*>(this), _member, access::shared));
+      mod->policy = policy;
+      modules::push(mod);
+    }
+
+    /// Queued requests to a batch handler are answered together, with the
+    /// object owned exclusively: group commit for handlers much cheaper per
+    /// item in bulk.
+    template<std::size_t prefix_size, typename Object>
+    inline void bind_batch(const char (&prefix)[prefix_size], batch_member_ptr<Object> _member, const batch_policy& policy = {})
+    {
+      auto mod(std::make_shared<_module_batch<Object>>(prefix, prefix_size, static_cast<Object*>(this), _member));
+      mod->batching = policy;
+      modules::push(mod);
+    }
+
+    template<std::size_t prefix_size, std::size_t regex_size, typename Object>
+    inline void bind_batch(const char (&prefix)[prefix_size], const char (&regex)[regex_size], batch_member_ptr<Object> _member, const batch_policy& policy = {})
+    {
+      auto mod(std::make_shared<_module_regex_batch<Object>>(prefix, prefix_size, regex, regex_size, static_cast<Object*>(this), _member));
+      mod->batching = policy;
+      modules::push(mod);
     }
 
     template<std::size_t prefix_size, typename Object>
@@ -220,11 +554,9 @@ namespace customsh
       : m_prefix(m_prefix_buffer)
       , m_log(m_log_buffer)
     {
-      m_log.reserve(4096);
-      std::stringstream pid;
-      pid << "0x" << std::hex << std::this_thread::get_id();
+      m_log.reserve(256);
       m_prefix_buffer
-        .append(pid.str())
+        .append(logger::thread_id())
         .append(1, '|')
         .append(file)
         .append(1, ':')
@@ -356,18 +688,18 @@ namespace customsh
       return *this;
     }
 
+    /// Hands the line to the asynchronous `logger`, never blocks on output.
     inline log& flush()
     {
+      std::string line;
+      line.reserve(m_prefix.size() + m_tab * 2 + m_log.size() + 3);
+      line.append(m_prefix);
       if (m_log.size())
       {
-        std::string tab;
-        tab.append(m_tab * 2, ' ');
-        std::cout << m_prefix << ": " << tab << m_log << std::endl;
-      }
-      else
-      {
-        std::cout << m_prefix << std::endl;
+        line.append(": ").append(m_tab * 2, ' ').append(m_log);
       }
+      line.append(1, '\n');
+      logger::write(line.data(), line.size());
       m_log.clear();
       return *this;
     }
@@ -392,6 +724,9 @@ namespace customsh
     inline nolog &nospace() { return *this; }
     inline nolog &quote() { return *this; }
     inline nolog &noquote() { return *this; }
+    inline nolog &tab() { return *this; }
+    inline nolog &notab() { return *this; }
+    inline nolog &flush() { return *this; }
     template<typename T>
     inline nolog &operator<<(const T&) { return *this; }
   };
@@ -444,11 +779,40 @@ namespace customsh
 #define customsh_log_(file, line, func) customsh::log(file, #line, func)
 #define customsh_log(file, line, func) customsh_log_(file, line, func)
 
-#define debug() customsh_log(__FILE__, __LINE__, __PRETTY_FUNCTION__)
-#define error() customsh_log(__FILE__, __LINE__, __PRETTY_FUNCTION__)
-#define warning() customsh_log(__FILE__, __LINE__, __PRETTY_FUNCTION__)
-#define info() customsh_log(__FILE__, __LINE__, __PRETTY_FUNCTION__)
-#define trace customsh_log(__FILE__, __LINE__, __PRETTY_FUNCTION__)
+/* Below the runtime threshold nothing is built and no argument evaluated. A
+   loop rather than an if, so `if (x) info() << y; else ...` stays unambiguous. */
+#define customsh_log_at(severity) \
+  for (bool customsh_log_once(customsh::logger::enabled(severity)); customsh_log_once; customsh_log_once = false) \
+    customsh_log(__FILE__, __LINE__, __PRETTY_FUNCTION__)
+/* Compiled out entirely: the statement is never executed. */
+#define customsh_nolog \
+  while (false) customsh::nolog(__FILE__, __LINE__, __PRETTY_FUNCTION__)
+
+#if CUSTOMSH_LOG_LEVEL <= CUSTOMSH_LOG_TRACE
+#define trace customsh_log_at(customsh::level::trace)
+#else
+#define trace customsh_nolog
+#endif
+
+#if CUSTOMSH_LOG_LEVEL <= CUSTOMSH_LOG_DEBUG
+#define debug() customsh_log_at(customsh::level::debug)
+#else
+#define debug() customsh_nolog
+#endif
+
+#if CUSTOMSH_LOG_LEVEL <= CUSTOMSH_LOG_INFO
+#define info() customsh_log_at(customsh::level::info)
+#else
+#define info() customsh_nolog
+#endif
+
+#if CUSTOMSH_LOG_LEVEL <= CUSTOMSH_LOG_WARNING
+#define warning() customsh_log_at(customsh::level::warning)
+#else
+#define warning() customsh_nolog
+#endif
+
+#define error() customsh_log_at(customsh::level::error)
 
 #endif
 
@@ -0,0 +1,285 @@
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "logger.hpp"
+
+namespace customsh
+{
+  namespace
+  {
+    /// Single producer (its thread), single consumer (the flusher) byte
+    /// ring. A line is published as a whole by moving `tail` past it.
+    struct ring
+    {
+      static constexpr std::size_t capacity = 1 << 16;
+
+      std::atomic<std::size_t> head;
+      std::atomic<std::size_t> tail;
+      std::atomic<std::size_t> dropped;
+      std::unique_ptr<char[]> data;
+
+      ring() : head(0), tail(0), dropped(0), data(new char[capacity]) { }
+    };
+
+    constexpr std::size_t ring::capacity;
+
+    using ring_ptr = std::shared_ptr<ring>;
+
+    /// Never destroyed: modules log from static destructors, in whatever
+    /// order those run.
+    struct state
+    {
+      std::mutex mutex;
+      std::vector<ring_ptr> rings;
+      std::string batch;
+      int fd = STDOUT_FILENO;
+      std::atomic<overflow> policy;
+      std::atomic<bool> started;
+      std::atomic<bool> stopped;
+      std::atomic<uint32_t> epoch;
+      std::atomic<bool> sleeping;
+
+      state() : policy(overflow::drop), started(false), stopped(false), epoch(0), sleeping(false) { }
+    };
+
+    state& instance();
+
+    void futex(std::atomic<uint32_t>& word, int op, uint32_t value, const timespec* timeout)
+    {
+      ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), op, value, timeout, nullptr, 0);
+    }
+
+    void write_all(int fd, const char* data, std::size_t size)
+    {
+      while (size)
+      {
+        auto n(::write(fd, data, size));
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0)
+          return;
+        data += n;
+        size -= n;
+      }
+    }
+
+    /// Moves what every ring holds to the sink. Called with the mutex held.
+    void drain(state& s)
+    {
+      s.batch.clear();
+      for (auto i(s.rings.begin()); i != s.rings.end(); )
+      {
+        auto& r(**i);
+        const auto head(r.head.load(std::memory_order_relaxed));
+        const auto tail(r.tail.load(std::memory_order_acquire));
+        const auto first(head % ring::capacity);
+        const auto size(tail - head);
+        const auto part(std::min(size, ring::capacity - first));
+        s.batch.append(r.data.get() + first, part);
+        s.batch.append(r.data.get(), size - part);
+        r.head.store(tail, std::memory_order_release);
+        if (auto dropped = r.dropped.exchange(0, std::memory_order_relaxed))
+          s.batch.append(std::to_string(dropped)).append(" log lines dropped\n");
+        /* Its thread is gone and so is everything it logged. */
+        if (i->use_count() == 1 && tail == r.tail.load(std::memory_order_acquire))
+          i = s.rings.erase(i);
+        else
+          ++ i;
+      }
+      write_all(s.fd, s.batch.data(), s.batch.size());
+    }
+
+    void wake(state& s)
+    {
+      if (s.sleeping.load(std::memory_order_acquire))
+      {
+        s.epoch.fetch_add(1, std::memory_order_release);
+        futex(s.epoch, FUTEX_WAKE_PRIVATE, 1, nullptr);
+      }
+    }
+
+    /// Drains every 10 ms, sooner when a ring fills up.
+    void flusher()
+    {
+      auto& s(instance());
+      const timespec nap = { 0, 10 * 1000 * 1000 };
+      while (!s.stopped.load(std::memory_order_acquire))
+      {
+        const auto epoch(s.epoch.load(std::memory_order_acquire));
+        {
+          std::lock_guard<std::mutex> locker(s.mutex);
+          drain(s);
+        }
+        s.sleeping.store(true, std::memory_order_seq_cst);
+        futex(s.epoch, FUTEX_WAIT_PRIVATE, epoch, &nap);
+        s.sleeping.store(false, std::memory_order_relaxed);
+      }
+    }
+
+    void start(state& s)
+    {
+      std::lock_guard<std::mutex> locker(s.mutex);
+      if (s.started.load(std::memory_order_relaxed) || s.stopped.load(std::memory_order_relaxed))
+        return;
+      std::thread(flusher).detach();
+      s.started.store(true, std::memory_order_release);
+    }
+
+    void stop()
+    {
+      auto& s(instance());
+      s.stopped.store(true, std::memory_order_release);
+      std::lock_guard<std::mutex> locker(s.mutex);
+      drain(s);
+    }
+
+    void before_fork()
+    {
+      auto& s(instance());
+      s.mutex.lock();
+      drain(s);
+    }
+
+    void after_fork_parent()
+    {
+      instance().mutex.unlock();
+    }
+
+    void after_fork_child()
+    {
+      auto& s(instance());
+      s.started.store(false, std::memory_order_relaxed);
+      s.sleeping.store(false, std::memory_order_relaxed);
+      s.mutex.unlock();
+    }
+
+    state& instance()
+    {
+      static state* s([]()
+      {
+        auto s(new state);
+        pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+        std::atexit(stop);
+        return s;
+      }());
+      return *s;
+    }
+
+    ring& local(state& s)
+    {
+      thread_local ring_ptr r;
+      if (!r)
+      {
+        r = std::make_shared<ring>();
+        std::lock_guard<std::mutex> locker(s.mutex);
+        s.rings.push_back(r);
+      }
+      return *r;
+    }
+  }
+
+  std::atomic<int> logger::s_threshold(CUSTOMSH_LOG_LEVEL);
+
+  static const char* const level_names[] = { "trace", "debug", "info", "warning", "error" };
+
+  void logger::threshold(level value)
+  {
+    s_threshold.store(std::max(int(value), CUSTOMSH_LOG_LEVEL), std::memory_order_relaxed);
+  }
+
+  const char* logger::name(level value)
+  {
+    return level_names[int(value)];
+  }
+
+  bool logger::parse(const std::string& name, level& value)
+  {
+    for (int i(CUSTOMSH_LOG_TRACE); i <= CUSTOMSH_LOG_ERROR; ++ i)
+    {
+      if (name == level_names[i])
+      {
+        value = level(i);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void logger::write(const char* line, std::size_t size)
+  {
+    auto& s(instance());
+    /* Once stopped, and for lines no ring could hold, write through in order. */
+    if (s.stopped.load(std::memory_order_acquire) || size > ring::capacity / 4)
+    {
+      std::lock_guard<std::mutex> locker(s.mutex);
+      drain(s);
+      write_all(s.fd, line, size);
+      return;
+    }
+    if (!s.started.load(std::memory_order_acquire))
+      start(s);
+
+    auto& r(local(s));
+    const auto tail(r.tail.load(std::memory_order_relaxed));
+    while (tail + size - r.head.load(std::memory_order_acquire) > ring::capacity)
+    {
+      if (s.policy.load(std::memory_order_relaxed) == overflow::drop)
+      {
+        r.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      wake(s);
+      std::this_thread::yield();
+    }
+    const auto first(tail % ring::capacity);
+    const auto part(std::min(size, ring::capacity - first));
+    std::memcpy(r.data.get() + first, line, part);
+    std::memcpy(r.data.get(), line + part, size - part);
+    r.tail.store(tail + size, std::memory_order_release);
+    if (tail + size - r.head.load(std::memory_order_relaxed) > ring::capacity / 2)
+      wake(s);
+  }
+
+  void logger::flush()
+  {
+    auto& s(instance());
+    std::lock_guard<std::mutex> locker(s.mutex);
+    drain(s);
+  }
+
+  void logger::sink(int fd)
+  {
+    auto& s(instance());
+    std::lock_guard<std::mutex> locker(s.mutex);
+    drain(s);
+    s.fd = fd;
+  }
+
+  void logger::policy(overflow value)
+  {
+    instance().policy.store(value, std::memory_order_relaxed);
+  }
+
+  const std::string& logger::thread_id()
+  {
+    thread_local const std::string id([]()
+    {
+      std::stringstream id;
+      id << "0x" << std::hex << std::this_thread::get_id();
+      return id.str();
+    }());
+    return id;
+  }
+}
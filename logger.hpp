@@ -0,0 +1,73 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <atomic>
+#include <string>
+#include <cstddef>
+
+/// Severities, lowest first. `CUSTOMSH_LOG_LEVEL` picks the lowest one that
+/// is compiled in at all, every call site below it is compiled out.
+#define CUSTOMSH_LOG_TRACE 0
+#define CUSTOMSH_LOG_DEBUG 1
+#define CUSTOMSH_LOG_INFO 2
+#define CUSTOMSH_LOG_WARNING 3
+#define CUSTOMSH_LOG_ERROR 4
+
+#ifndef CUSTOMSH_LOG_LEVEL
+#define CUSTOMSH_LOG_LEVEL CUSTOMSH_LOG_INFO
+#endif
+
+namespace customsh
+{
+  enum class level : int
+  {
+    trace = CUSTOMSH_LOG_TRACE,
+    debug = CUSTOMSH_LOG_DEBUG,
+    info = CUSTOMSH_LOG_INFO,
+    warning = CUSTOMSH_LOG_WARNING,
+    error = CUSTOMSH_LOG_ERROR,
+  };
+
+  /// What a thread does with a new line when its log ring is full.
+  enum class overflow
+  {
+    drop,
+    block,
+  };
+
+  /// Backend of `customsh::log`. Every thread appends finished lines to its
+  /// own lock-free ring, a background thread collects all rings and writes
+  /// them to the sink in one batch, so the request path never makes a
+  /// syscall to log. Dropped lines are counted and reported by the flusher.
+  /// Survives `fork()`: the rings are drained before it and the flusher is
+  /// restarted in the child on the next line.
+  class logger
+  {
+  public:
+    /// Queues one complete line, newline included.
+    static void write(const char* line, std::size_t size);
+    /// Writes out everything queued so far before returning.
+    static void flush();
+
+    /// File descriptor lines go to, stdout by default.
+    static void sink(int fd);
+    static void policy(overflow value);
+
+    /// Runtime threshold among the levels compiled in. A line below it
+    /// costs one relaxed load.
+    static inline bool enabled(level value) { return int(value) >= s_threshold.load(std::memory_order_relaxed); }
+    static inline level threshold() { return level(s_threshold.load(std::memory_order_relaxed)); }
+    static void threshold(level value);
+    static const char* name(level value);
+    /// Returns false when `name` is not a level.
+    static bool parse(const std::string& name, level& value);
+
+    /// `0x<thread id>`, formatted once per thread.
+    static const std::string& thread_id();
+
+  private:
+    static std::atomic<int> s_threshold;
+  };
+}
+
+#endif
@@ -1,12 +1,17 @@
 #include <iostream>
 #include <thread>
 #include <vector>
-#include <sstream>
 #include <algorithm>
 #include <map>
+#include <unordered_map>
 #include <queue>
-#include <condition_variable>
+#include <deque>
 #include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <functional>
+#include <condition_variable>
+#include <system_error>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -16,134 +21,1224 @@
 #include <sys/epoll.h>
 #include <errno.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 
 #include "customsh.hpp"
 #include "daemonized.hpp"
 #include "ns.hpp"
 #include "sh.hpp"
+#include "queue.hpp"
+#include "buffer.hpp"
+#include "uring.hpp"
+#include "spawner.hpp"
+#include "await.hpp"
 
 #define WORKER_COUNT 10
+#define REACTOR_COUNT 1
+/// Connections a reactor accepts per wakeup before leaving the rest to its peers.
+#define ACCEPT_BATCH 16
+#define PINNED_COUNT 2
+/// Largest chunk of a streamed reply, and how much of it a connection may
+/// have queued before the handler writing it waits for the client.
+#define CHUNK_SIZE (64 << 10)
+#define STREAM_BACKLOG (4 * CHUNK_SIZE)
+/// How long a streaming handler waits for the client to take some of that
+/// before the connection is given up on.
+#define STREAM_TIMEOUT std::chrono::seconds(10)
+/// Requests of protocol v2 a connection may have unanswered. Its input is
+/// neither parsed nor read past that until some are answered.
+#define TAGGED_BACKLOG 256
+/// Bytes of replies a connection may have queued. Its input is neither
+/// parsed nor read past that, nor its next pipelined request run, until the
+/// client takes some.
+#define OUTPUT_BACKLOG (16 * CHUNK_SIZE)
+
+struct connection;
+
+using connection_ptr = std::shared_ptr<connection>;
 
-struct request
+struct request;
+
+using request_ptr = std::shared_ptr<request>;
+
+struct request : public customsh::job
 {
-  int fd = -1;
-  std::vector<char> query;
-  customsh::module_ptr module;
+  connection_ptr conn;
+  std::string query;
+  /* Length of the `@<netns> ` tag routing the query to a pool, see route(). */
+  std::size_t offset = 0;
+  /* Queue of the workers that answer it, the default one when nullptr. */
+  customsh::queue<request_ptr>* queue = nullptr;
+  customsh::module* module = nullptr;
+  bool owned = false;
+  /* Answered later through a `deferred_reply`. */
+  bool deferred = false;
+  /* An exclusive object kept until both the handler returned and its
+     deferred reply is sent, see `unhold()`. */
+  std::atomic<int> holding { 0 };
+  /* Set instead of `conn` for a `customsh::call` from a coroutine. */
+  customsh::deferred_ptr caller;
+  /* Identical requests wait for this one's reply, see `attach()`. */
+  bool leading = false;
+  /* Gathers the requests of its batch binding, see `join()`. */
+  bool collecting = false;
+  /* Cache ticket taken before calling the handler. */
+  uint64_t ticket = 0;
+  /* Set instead of everything else for a coroutine resumed on a worker. */
+  std::function<void()> work;
+  /* A multi-command frame: its commands run as requests of their own, their
+     sealed replies are kept at their place until the last one is in. */
+  bool multi = false;
+  bool malformed = false;
+  std::vector<request_ptr> parts;
+  std::vector<customsh::buffer_ptr> replies;
+  std::atomic<std::size_t> missing { 0 };
+  /* Set instead of `conn` for a command of a multi-command frame. */
+  request_ptr whole;
+  std::size_t part = 0;
+  /* Protocol v2: answered as soon as it is done, with its client's id. */
+  bool tagged = false;
+  uint32_t id = 0;
 
   request() = delete;
   request(const request&) = delete;
   request(const request&&) = delete;
-  request(int _fd) : fd(_fd) { query.reserve(2048); }
-  ~request()
+  request(connection_ptr _conn, const char* _query, std::size_t _query_size)
+    : conn(_conn)
+    , query(_query, _query_size)
+  {
+  }
+  request(std::function<void()> _work)
+    : work(std::move(_work))
+  {
+  }
+};
+
+enum : uint32_t
+{
+  reply_ok = 0,
+  reply_bad_argument = 1,
+  reply_not_found = 2,
+  reply_failed = 3,
+  /* A chunk of a streamed reply, the last frame carries the status. */
+  reply_more = 4,
+};
+
+/// Set in the length of a frame carrying several `[len][cmd]` records. It
+/// is answered by one `[ret][size]` frame holding a `[ret][size][out]` record
+/// per command, in order.
+static constexpr uint32_t multi_frame = 0x80000000;
+
+/// Set in the length of a hello frame, whose payload is the protocol version
+/// the client speaks. It is answered with `[ret][4][version]`, the version
+/// both sides speak from then on. From version 2 on, frames carry a client
+/// chosen id after the length, `[len][id][cmd]`, and are answered by
+/// `[ret][size][id][out]` as soon as each is done, in any order. Version 3
+/// also streams large replies of shared bindings as `reply_more` frames of
+/// that form, then a last frame with the status and the rest; a client
+/// drops what came before a failed one. A hello is only accepted on a v1 connection with
+/// nothing outstanding, it is refused in order otherwise.
+static constexpr uint32_t hello_frame = 0x40000000;
+static constexpr uint32_t protocol_version = 3;
+
+/// A frame that is answered with `bad_argument` and nothing else.
+static request_ptr refuse(const connection_ptr& conn)
+{
+  auto req(std::make_shared<request>(conn, nullptr, 0));
+  req->multi = true;
+  req->malformed = true;
+  return req;
+}
+
+/// The request of a multi-command frame with its `size` bytes of records.
+static request_ptr unpack(const connection_ptr& conn, const char* records, std::size_t size)
+{
+  auto req(std::make_shared<request>(conn, nullptr, 0));
+  req->multi = true;
+  std::size_t offset(0);
+  while (offset < size)
+  {
+    uint32_t query_size;
+    if (size - offset < sizeof(query_size))
+      break;
+    std::memcpy(&query_size, records + offset, sizeof(query_size));
+    offset += sizeof(query_size);
+    if (size - offset < query_size)
+      break;
+    auto part(std::make_shared<request>(nullptr, records + offset, query_size));
+    part->part = req->parts.size();
+    req->parts.emplace_back(std::move(part));
+    offset += query_size;
+  }
+  if (offset != size)
+  {
+    req->malformed = true;
+    req->parts.clear();
+  }
+  req->replies.resize(req->parts.size());
+  req->missing = req->parts.size();
+  return req;
+}
+
+/// One client socket. Frames are parsed by the event loop as they arrive and
+/// answered strictly in order: only the head of `pending` is ever handed to a
+/// worker, the next one is released when its predecessor has been answered.
+/// Replies are queued on the connection and sent without ever blocking; what
+/// the socket does not take right away is drained by the event loop on
+/// EPOLLOUT. Connections of a completion ring reactor do not send at all,
+/// they hand themselves to the reactor through `notify` instead.
+struct connection : public std::enable_shared_from_this<connection>
+{
+  int fd = -1;
+
+  connection() = delete;
+  connection(const connection&) = delete;
+  connection(const connection&&) = delete;
+  connection(int _fd, int _epoll_fd) : fd(_fd), m_epoll_fd(_epoll_fd) { m_input.reserve(2048); }
+  connection(int _fd, std::function<void(const connection_ptr&)> _notify) : fd(_fd), m_notify(_notify) { m_input.reserve(2048); }
+  ~connection()
   {
     if (fd >= 0)
     {
       close(fd);
     }
   }
-  inline bool load(char* buff, std::size_t size)
+  /// Appends received bytes and splits off every complete frame: `[len][cmd]`,
+  /// multi-command and hello ones, then `[len][id][cmd]` once protocol v2 is
+  /// in use. Appends the requests that must be dispatched now to `ready`.
+  /// Stops at `TAGGED_BACKLOG` unanswered requests or `OUTPUT_BACKLOG`
+  /// queued bytes, the event loop calls it again without bytes once `done()`
+  /// or the client taking its output wakes it, see `throttled()`.
+  inline void load(const char* buff, std::size_t size, std::vector<request_ptr>& ready)
+  {
+    m_input.insert(m_input.end(), buff, buff + size);
+    {
+      std::lock_guard<std::mutex> locker(m_mutex);
+      m_resume = false;
+      if (m_held && !full())
+      {
+        m_held = false;
+        ready.emplace_back(m_pending.front());
+        m_pending.pop();
+      }
+    }
+    std::size_t offset(0);
+    while (!throttled())
+    {
+      const std::size_t header_size((m_tagged ? 2 : 1) * sizeof(uint32_t));
+      if (m_input.size() - offset < header_size)
+        break;
+      uint32_t header[2];
+      std::memcpy(header, m_input.data() + offset, header_size);
+      const bool multi(header[0] & multi_frame);
+      const bool hello(header[0] & hello_frame);
+      const uint32_t query_size(header[0] & ~(multi_frame | hello_frame));
+      if (m_input.size() - offset - header_size < query_size)
+        break;
+      const auto query(m_input.data() + offset + header_size);
+      offset += header_size + query_size;
+      auto req(hello ? negotiate(query, query_size) : multi ? unpack(shared_from_this(), query, query_size) : std::make_shared<request>(shared_from_this(), query, query_size));
+      if (!req)
+        continue;
+      std::lock_guard<std::mutex> locker(m_mutex);
+      if (m_tagged)
+      {
+        req->tagged = true;
+        req->id = header[1];
+        ++ m_running;
+        ready.emplace_back(std::move(req));
+      }
+      else if (m_busy)
+      {
+        m_pending.emplace(req);
+      }
+      else
+      {
+        m_busy = true;
+        ready.emplace_back(std::move(req));
+      }
+    }
+    m_input.erase(m_input.begin(), m_input.begin() + offset);
+    std::lock_guard<std::mutex> locker(m_mutex);
+    update();
+  }
+  /// Whether `done()` made room since the input was last parsed.
+  inline bool resuming()
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    return m_resume;
+  }
+  /// Whether the event loop should leave the input alone for now.
+  inline bool throttled()
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    return full();
+  }
+  /// Called once a request has been answered. Returns the next one when
+  /// replies go in order, unless the client is behind on taking them: then
+  /// `load()` hands it over once the output drained.
+  inline request_ptr done()
   {
-    query.insert(query.end(), buff, buff + size);
-    if (!query_size && query.size() > sizeof(uint32_t))
+    request_ptr next;
+    std::lock_guard<std::mutex> locker(m_mutex);
+    if (m_running)
+    {
+      /* Below the cap again, the event loop parses and reads what is left. */
+      if (m_running-- == TAGGED_BACKLOG)
+        m_resume = true;
+      if (!m_running || m_resume)
+        wake();
+    }
+    else if (m_pending.size() && full())
+    {
+      m_held = true;
+    }
+    else if (m_pending.size())
+    {
+      next = m_pending.front();
+      m_pending.pop();
+    }
+    else
     {
-      query_size = *(uint32_t*)query.data() + sizeof(uint32_t);
-      query.reserve(query_size + 1);
+      m_busy = false;
+      wake();
     }
-    if (query_size >= query.size())
+    return next;
+  }
+  /// Queues a sealed reply frame and sends as much as the socket takes.
+  inline void write(customsh::buffer_ptr out)
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    queue(std::move(out));
+  }
+  /// Whether replies may be streamed in chunks, see `stream()`.
+  inline bool chunked() const
+  {
+    return m_chunked;
+  }
+  /// Whether `req` may stream its reply now. One does at a time, so a slow
+  /// reader holds back a single worker: the others wait here, out of the
+  /// workers' way, for `unstream()` to hand them the turn.
+  inline bool enstream(const request_ptr& req)
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    if (!m_streaming || m_streaming == req)
     {
-      if (query.size() == query_size)
-        query.emplace_back(0);
+      m_streaming = req;
       return true;
     }
+    m_streams.push(req);
     return false;
   }
+  /// The streamed reply of the current request is done with. Returns the
+  /// request whose turn it is now, to be dispatched again.
+  inline request_ptr unstream()
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    m_streaming.reset();
+    if (m_streams.empty())
+      return request_ptr();
+    m_streaming = m_streams.front();
+    m_streams.pop();
+    return m_streaming;
+  }
+  /// Queues a chunk of a streamed reply, then waits for the client to take
+  /// enough of what is queued: a slow reader holds the handler back rather
+  /// than have its whole reply pile up here. One that takes nothing for
+  /// `STREAM_TIMEOUT` loses its connection. Returns false once the
+  /// connection is broken, the rest of the reply goes nowhere.
+  inline bool stream(customsh::buffer_ptr out)
+  {
+    std::unique_lock<std::mutex> locker(m_mutex);
+    queue(std::move(out));
+    if (!m_drained.wait_for(locker, STREAM_TIMEOUT, [this]() { return m_broken || m_queued <= STREAM_BACKLOG; }))
+    {
+      error() << "client stopped reading a streamed reply";
+      abandon();
+    }
+    return !m_broken;
+  }
+  /// The event loop saw EPOLLOUT. Returns true once the connection is done
+  /// with and can be dropped.
+  inline bool writable()
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    flush();
+    update();
+    return finished();
+  }
+  /// The client closed its side. Frames already received are still answered.
+  inline bool shutdown()
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    m_input_closed = true;
+    /* A streaming handler learns right away if the client is gone for good. */
+    if (!m_notify)
+      flush();
+    m_drained.notify_all();
+    update();
+    return finished();
+  }
+  /// Completion ring side: fills `iov` with the queued output and returns
+  /// how many entries it used.
+  inline std::size_t gather(iovec* iov, std::size_t max)
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    m_scheduled = false;
+    return m_broken ? 0 : gather_locked(iov, max);
+  }
+  /// Completion ring side: `size` bytes of the gathered output went out, a
+  /// negative `size` is the error that broke the connection.
+  inline void sent(long size)
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    if (size < 0)
+    {
+      m_broken = true;
+      m_output.clear();
+      m_queued = 0;
+      m_drained.notify_all();
+    }
+    else
+    {
+      advance(size);
+    }
+  }
+  inline bool closable()
+  {
+    std::lock_guard<std::mutex> locker(m_mutex);
+    return finished();
+  }
 private:
-  uint32_t query_size = 0;
-};
+  std::vector<char> m_input;
+  int m_epoll_fd = -1;
+  std::mutex m_mutex;
+  std::queue<request_ptr> m_pending;
+  bool m_busy = false;
+  std::deque<customsh::buffer_ptr> m_output;
+  std::size_t m_sent = 0;
+  bool m_input_closed = false;
+  bool m_broken = false;
+  uint32_t m_events = EPOLLIN;
+  std::function<void(const connection_ptr&)> m_notify;
+  bool m_scheduled = false;
+  /* Protocol v2 from now on, touched by the event loop only. */
+  bool m_tagged = false;
+  /* Requests of v2 not answered yet. */
+  std::size_t m_running = 0;
+  /* Set by `done()` when `m_running` went back under the cap, and when the
+     output drained back under `OUTPUT_BACKLOG`. */
+  bool m_resume = false;
+  /* `done()` kept the next pending request back for the output to drain. */
+  bool m_held = false;
+  /* Protocol v3, set before its first request is dispatched. */
+  bool m_chunked = false;
+  /* Bytes in `m_output` not sent yet, streaming handlers wait on `m_drained`
+     while there are too many. */
+  std::size_t m_queued = 0;
+  std::condition_variable m_drained;
+  /* The request streaming its reply, and those waiting for their turn. */
+  request_ptr m_streaming;
+  std::queue<request_ptr> m_streams;
 
-using request_ptr = std::shared_ptr<request>;
+  inline void queue(customsh::buffer_ptr out)
+  {
+    if (m_broken)
+      return;
+    m_queued += out->size();
+    m_output.emplace_back(std::move(out));
+    if (m_output.size() == 1 && !m_notify)
+      flush();
+    wake();
+  }
 
-class request_queue
-{
-  std::atomic<bool>& m_running;
-  std::mutex m_mutex;
-  std::queue<request_ptr> m_queue;
-  std::condition_variable m_not_empty;
-public:
-  request_queue(std::atomic<bool>& running) : m_running(running) { }
-  void put(request_ptr req)
+  inline bool full() const
   {
-    std::unique_lock<std::mutex>(m_mutex);
-    m_queue.emplace(req);
-    m_not_empty.notify_one();
+    return (m_tagged && m_running >= TAGGED_BACKLOG) || m_queued > OUTPUT_BACKLOG;
   }
-  request_ptr get()
+
+  /// Gives up on the client: nothing more is sent, the event loop drops the
+  /// connection. Frames a completion ring may be sending stay alive until
+  /// the send completes.
+  void abandon()
   {
-    std::unique_lock<std::mutex> locker(m_mutex);
-    while (m_running && m_queue.size() == 0)
+    m_broken = true;
+    if (!m_notify)
+      m_output.clear();
+    m_queued = 0;
+    m_drained.notify_all();
+    wake();
+  }
+
+  inline bool finished() const
+  {
+    return m_broken || (m_input_closed && !m_busy && !m_running && m_output.empty());
+  }
+
+  /// Answers a hello frame right away, the connection being idle, or
+  /// returns the request refusing it in order.
+  request_ptr negotiate(const char* payload, std::size_t size)
+  {
+    uint32_t version(0);
+    if (size == sizeof(version))
+      std::memcpy(&version, payload, sizeof(version));
     {
-      m_not_empty.wait(locker);
+      std::lock_guard<std::mutex> locker(m_mutex);
+      if (m_tagged || m_busy || !version)
+        return refuse(shared_from_this());
     }
-    request_ptr req;
-    if (m_running)
+    version = std::min(version, protocol_version);
+    auto out(customsh::buffer::get());
+    out->sputn(reinterpret_cast<const char*>(&version), sizeof(version));
+    out->seal(reply_ok);
+    write(std::move(out));
+    m_tagged = version >= 2;
+    m_chunked = version >= 3;
+    return request_ptr();
+  }
+
+  /// Sends queued frames, several per syscall, until the socket is full.
+  void flush()
+  {
+    while (m_output.size())
     {
-      req = m_queue.front();
-      m_queue.pop();
+      iovec iov[64];
+      auto count(gather_locked(iov, 64));
+      msghdr msg;
+      std::memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      auto n(sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT));
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+          m_broken = true;
+          m_output.clear();
+          m_queued = 0;
+          m_drained.notify_all();
+        }
+        return;
+      }
+      advance(n);
+    }
+  }
+
+  std::size_t gather_locked(iovec* iov, std::size_t max)
+  {
+    std::size_t count(0);
+    for (auto i(m_output.begin()); i != m_output.end() && count < max; ++ i, ++ count)
+    {
+      const std::size_t skip(count ? 0 : m_sent);
+      iov[count].iov_base = const_cast<char*>((*i)->data()) + skip;
+      iov[count].iov_len = (*i)->size() - skip;
+    }
+    return count;
+  }
+
+  /// Drops the frames `sent` bytes have completed.
+  void advance(std::size_t sent)
+  {
+    /* Back under the limit, the event loop reads and runs what is left. */
+    if (m_queued > OUTPUT_BACKLOG && m_queued - sent <= OUTPUT_BACKLOG)
+      m_resume = true;
+    m_queued -= sent;
+    if (m_queued <= STREAM_BACKLOG)
+      m_drained.notify_all();
+    while (m_output.size() && sent >= m_output.front()->size() - m_sent)
+    {
+      sent -= m_output.front()->size() - m_sent;
+      m_sent = 0;
+      m_output.pop_front();
+    }
+    m_sent += sent;
+  }
+
+  /// Lets the event loop know about new output, or that the connection is
+  /// done with.
+  void wake()
+  {
+    if (!m_notify)
+      return update();
+    if (!m_scheduled && (m_output.size() || finished() || m_resume))
+    {
+      m_scheduled = true;
+      m_notify(shared_from_this());
+    }
+  }
+
+  /// Asks for EPOLLOUT while output is pending, once more after the input was
+  /// closed and the last request finished, so the event loop can drop the
+  /// connection, and once the input may be parsed again. No EPOLLIN while
+  /// the connection is full.
+  void update()
+  {
+    if (m_epoll_fd < 0)
+      return;
+    /* Edge triggered once the input is closed, a lingering EPOLLHUP would spin the loop otherwise. */
+    uint32_t events(m_input_closed || full() ? EPOLLET : EPOLLIN);
+    if (m_output.size() || finished() || m_resume)
+      events |= EPOLLOUT;
+    if (events != m_events)
+    {
+      m_events = events;
+      epoll_event event;
+      event.data.fd = fd;
+      event.events = events;
+      epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &event);
     }
-    return req;
   }
 };
 
 static std::atomic<bool> running(true);
-static request_queue requests(running);
-static std::map<int, request_ptr> buffers;
+static customsh::queue<request_ptr> requests;
+
+/// Workers that stay in one network namespace for good, see `-n`.
+struct pool
+{
+  const std::string netns;
+  customsh::queue<request_ptr> queue;
+  std::vector<std::thread> threads;
+
+  pool(const std::string& _netns) : netns(_netns), queue(1 << 12) { }
+};
+
+/* Filled before the first request, read-only afterwards. */
+static std::map<std::string, std::unique_ptr<pool>> pools;
+
+static inline customsh::queue<request_ptr>& queue_of(const request_ptr& req)
+{
+  return req->queue ? *req->queue : requests;
+}
+
+static inline customsh::module* module_of(const request_ptr& req)
+{
+  return customsh::modules::get(req->query.data() + req->offset, req->query.size() - req->offset);
+}
+
+/// Sends a query tagged `@<netns> ` to the pool pinned to that namespace.
+/// The tag stays part of the query for coalescing, the cache keys replies by
+/// pool instead. An unknown one is left to fail the module lookup.
+static void route(const request_ptr& req)
+{
+  if (req->query.empty() || req->query[0] != '@' || pools.empty())
+    return;
+  const auto space(req->query.find(' '));
+  if (space == std::string::npos)
+    return;
+  auto i(pools.find(req->query.substr(1, space - 1)));
+  if (i == pools.end())
+    return;
+  req->queue = &i->second->queue;
+  req->offset = space + 1;
+}
 
 static void termination(int)
 {
   running = false;
 }
 
-static void worker()
+static void finish(const request_ptr& req, customsh::buffer_ptr out);
+
+/// Answers a multi-command frame with the replies of all its commands.
+static void complete(const request_ptr& whole)
 {
-  while (running)
+  auto out(customsh::buffer::get());
+  for (const auto& reply : whole->replies)
+    out->sputn(reply->data(), reply->size());
+  whole->replies.clear();
+  out->seal(whole->malformed ? reply_bad_argument : reply_ok);
+  finish(whole, std::move(out));
+}
+
+/// Queues `req` for the workers, or parks it right away when its object is
+/// busy so no worker has to be woken just to find that out. Cached and
+/// coalesced bindings are never parked, their reply may not need the object,
+/// nor are batch bindings, whose requests gather in `join()` instead.
+/// Commands of a multi-command frame take their object here, in frame order,
+/// so those for one object apply in order as on separate frames.
+static void dispatch(const request_ptr& req)
+{
+  if (req->multi)
+  {
+    /* Its commands spread over the workers, only those for one object wait
+       for each other. */
+    std::vector<request_ptr> parts;
+    parts.swap(req->parts);
+    if (parts.empty())
+      complete(req);
+    for (const auto& part : parts)
+    {
+      part->whole = req;
+      dispatch(part);
+    }
+    return;
+  }
+  route(req);
+  try
   {
-    std::stringstream cout;
-    auto req(requests.get());
-    if (running); else break;
+    req->module = module_of(req);
+    auto object(req->module->object());
+    const auto& policy(req->module->policy);
+    if (object && req->whole && !req->module->batch())
+    {
+      if (!object->acquire(req, req->module->mode))
+        return;
+      req->owned = true;
+    }
+    else if (object && !policy.ttl.count() && !policy.coalesce && !req->module->batch() && object->park(req, req->module->mode))
+      return;
+  }
+  catch (const customsh::not_found& ex)
+  {
+  }
+  queue_of(req).put(req);
+}
+
+/// Hands a sealed reply to the client, to the coroutine that made the
+/// request with `customsh::call`, or to the multi-command frame it is part of.
+static void deliver(const request_ptr& req, customsh::buffer_ptr out)
+{
+  if (req->whole)
+  {
+    auto& whole(req->whole);
+    whole->replies[req->part] = std::move(out);
+    if (whole->missing.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      complete(whole);
+    return;
+  }
+  if (req->conn)
+  {
+    if (req->tagged)
+      out->tag(req->id);
+    req->conn->write(std::move(out));
+    return;
+  }
+  uint32_t status;
+  std::memcpy(&status, out->data(), sizeof(status));
+  if (status == reply_ok)
+    req->caller->send(std::string(out->data() + customsh::buffer::header_size, out->size() - customsh::buffer::header_size));
+  else if (status == reply_not_found)
+    req->caller->fail(customsh::not_found());
+  else
+    req->caller->fail(customsh::bad_argument());
+}
+
+/// Gives up the object of an exclusive request answered later, once both
+/// its handler returned and its reply is sent. The parked requests it hands
+/// over go to their workers.
+static void unhold(const request_ptr& req)
+{
+  if (req->holding.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    return;
+  std::vector<customsh::job_ptr> handed;
+  req->module->object()->release(req->module->mode, handed);
+  for (const auto& j : handed)
+  {
+    auto other(std::static_pointer_cast<request>(j));
+    other->owned = true;
+    queue_of(other).put(other);
+  }
+}
+
+/// Delivers the reply of a request answered outside of its worker's loop and
+/// moves its connection on to the next request.
+static void finish(const request_ptr& req, customsh::buffer_ptr out)
+{
+  deliver(req, std::move(out));
+  if (req->holding.load(std::memory_order_acquire))
+    unhold(req);
+  auto next(req->conn ? req->conn->done() : request_ptr());
+  if (next)
+  {
+    dispatch(next);
+  }
+}
+
+/// Requests waiting for an identical one to be answered, by query.
+static std::mutex inflight_mutex;
+static std::unordered_map<std::string, std::vector<request_ptr>> inflight;
+
+/// Attaches `req` to the identical query already running and returns true,
+/// or makes it the one later arrivals attach to.
+static bool attach(const request_ptr& req)
+{
+  std::lock_guard<std::mutex> locker(inflight_mutex);
+  auto i(inflight.find(req->query));
+  if (i == inflight.end())
+  {
+    inflight.emplace(req->query, std::vector<request_ptr>());
+    req->leading = true;
+    return false;
+  }
+  i->second.emplace_back(req);
+  return true;
+}
+
+/// Answers the requests attached to `req` with a copy of its sealed reply.
+/// The next identical query runs again.
+static void detach(const request_ptr& req, const customsh::buffer& out)
+{
+  if (!req->leading)
+    return;
+  req->leading = false;
+  std::vector<request_ptr> attached;
+  {
+    std::lock_guard<std::mutex> locker(inflight_mutex);
+    auto i(inflight.find(req->query));
+    attached.swap(i->second);
+    inflight.erase(i);
+  }
+  uint32_t status;
+  std::memcpy(&status, out.data(), sizeof(status));
+  for (auto& other : attached)
+  {
+    auto copy(customsh::buffer::get());
+    copy->sputn(out.data() + customsh::buffer::header_size, out.size() - customsh::buffer::header_size);
+    copy->seal(status);
+    finish(other, std::move(copy));
+  }
+}
+
+/// Requests to a batch binding waiting for the one collecting them. There
+/// is one per pool, a batch runs in the namespace of its workers.
+struct batch_queue
+{
+  std::vector<request_ptr> waiting;
+  bool collecting = false;
+  std::condition_variable more;
+};
+
+static std::mutex batches_mutex;
+static std::map<std::pair<customsh::module*, customsh::queue<request_ptr>*>, batch_queue> batches;
+
+static inline batch_queue& batch_of(const request_ptr& req)
+{
+  return batches[std::make_pair(req->module, &queue_of(req))];
+}
+
+/// Adds `req` to the batch being collected for its binding and returns true,
+/// or makes it the one collecting the next batch.
+static bool join(const request_ptr& req)
+{
+  std::lock_guard<std::mutex> locker(batches_mutex);
+  auto& batch(batch_of(req));
+  if (!batch.collecting)
+  {
+    batch.collecting = true;
+    req->collecting = true;
+    return false;
+  }
+  batch.waiting.emplace_back(req);
+  if (batch.waiting.size() + 1 >= req->module->batch()->batching.max)
+    batch.more.notify_one();
+  return true;
+}
+
+/// Called by the collecting request once it owns the object: lingers for
+/// more as the binding allows and takes the batch, `req` first.
+static std::vector<request_ptr> collect(const request_ptr& req)
+{
+  const auto& policy(req->module->batch()->batching);
+  std::unique_lock<std::mutex> locker(batches_mutex);
+  auto& batch(batch_of(req));
+  batch.more.wait_for(locker, policy.linger, [&batch, &policy]() { return batch.waiting.size() + 1 >= policy.max; });
+  const auto count(std::min(batch.waiting.size(), std::max<std::size_t>(policy.max, 1) - 1));
+  std::vector<request_ptr> taken { req };
+  taken.insert(taken.end(), batch.waiting.begin(), batch.waiting.begin() + count);
+  batch.waiting.erase(batch.waiting.begin(), batch.waiting.begin() + count);
+  return taken;
+}
+
+/// The batch of `req` has been called: the first request left over collects
+/// the next one.
+static void handoff(const request_ptr& req)
+{
+  request_ptr next;
+  {
+    std::lock_guard<std::mutex> locker(batches_mutex);
+    auto& batch(batch_of(req));
+    req->collecting = false;
+    if (batch.waiting.empty())
+    {
+      batch.collecting = false;
+      return;
+    }
+    next = batch.waiting.front();
+    batch.waiting.erase(batch.waiting.begin());
+    next->collecting = true;
+  }
+  /* Still deferred, it is finished like the rest of its batch. */
+  queue_of(next).put(next);
+}
+
+/// Calls the batch handler with the requests `collect()` took and seals
+/// one reply per request in `outs`, in the same order. The handler throwing
+/// fails the whole batch.
+static void call_batch(const std::vector<request_ptr>& taken, std::vector<customsh::buffer_ptr>& outs)
+{
+  auto module(taken.front()->module->batch());
+  std::deque<std::ostream> streams;
+  std::vector<customsh::batched> items;
+  /* Submatches point into the items, they must not move. */
+  items.reserve(taken.size());
+  std::vector<std::size_t> index;
+  for (std::size_t i(0); i < taken.size(); ++ i)
+  {
+    const auto& req(taken[i]);
+    outs.emplace_back(customsh::buffer::get());
+    streams.emplace_back(outs.back().get());
+    items.push_back({ customsh::args(), streams.back(), nullptr });
     try
     {
-      if (!req->module)
-      {
-        req->module = customsh::modules::get(req->query.data() + sizeof(uint32_t));
-      }
-      info() << "call" << req->query;
-      req->module->call(req->query.data() + sizeof(uint32_t) + req->module->prefix_size, cout);
-      uint32_t msg_ret(0);
-      uint32_t msg_size(cout.str().size());
-      const char* msg(cout.str().c_str());
-      write(req->fd, &msg_ret, sizeof(msg_ret));
-      write(req->fd, &msg_size, sizeof(msg_size));
-      write(req->fd, msg, msg_size);
-      fsync(req->fd);
+      module->parse(req->query.substr(std::min(req->query.size(), req->offset + module->prefix_size - 1)), items.back().args);
+      index.push_back(i);
     }
     catch (const customsh::bad_argument& ex)
     {
-      error() << "bad_argument";
+      items.pop_back();
+      outs.back()->seal(reply_bad_argument);
+    }
+  }
+  std::exception_ptr failed;
+  if (items.size())
+  {
+    info() << "call batch of" << items.size() << taken.front()->query;
+    try
+    {
+      module->call(items);
+    }
+    catch (...)
+    {
+      failed = std::current_exception();
+    }
+  }
+  for (std::size_t i(0); i < items.size(); ++ i)
+  {
+    auto& out(outs[index[i]]);
+    auto thrown(failed ? failed : items[i].failed);
+    if (!thrown)
+    {
+      items[i].cout.flush();
+      out->seal(reply_ok);
+      continue;
+    }
+    out->reset();
+    try
+    {
+      std::rethrow_exception(thrown);
     }
     catch (const customsh::not_found& ex)
     {
-      error() << "not_found" << req->query;
+      out->seal(reply_not_found);
+    }
+    catch (const customsh::bad_argument& ex)
+    {
+      out->seal(reply_bad_argument);
+    }
+    catch (...)
+    {
+      out->seal(reply_failed);
+    }
+  }
+}
+
+/// The reply of a request whose handler called `customsh::defer()`. The
+/// connection stays busy until it is sent, so replies keep their order.
+struct deferred_reply : public customsh::deferred
+{
+  request_ptr req;
+  std::atomic<bool> sent;
+
+  deferred_reply(const request_ptr& _req) : req(_req), sent(false) { }
+  ~deferred_reply()
+  {
+    reply(reply_failed, std::string());
+  }
+  void send(const std::string& payload)
+  {
+    reply(reply_ok, payload);
+  }
+  void fail(const std::exception& error)
+  {
+    if (dynamic_cast<const customsh::not_found*>(&error))
+      reply(reply_not_found, std::string());
+    else if (dynamic_cast<const customsh::bad_argument*>(&error))
+      reply(reply_bad_argument, std::string());
+    else
+      reply(reply_failed, std::string());
+  }
+  void reply(uint32_t status, const std::string& payload)
+  {
+    if (sent.exchange(true))
+      return;
+    if (status == reply_ok && req->module && req->module->policy.ttl.count())
+      customsh::cache::put(req->queue, req->query.substr(req->offset), req->module->object(), req->module->policy.ttl, payload.data(), payload.size(), req->ticket);
+    auto out(customsh::buffer::get());
+    out->sputn(payload.data(), payload.size());
+    out->seal(status);
+    detach(req, *out);
+    finish(req, std::move(out));
+  }
+};
+
+/// Answers `req`, or returns false when it had to be parked on its busy
+/// object or wait for its connection to stream another reply. `req->owned`
+/// is set when the object was handed over by release().
+static bool answer(const request_ptr& req, std::ostream& cout)
+{
+  auto out(customsh::buffer::get());
+  cout.rdbuf(out.get());
+  cout.clear();
+  customsh::deferred_ptr later;
+  bool streamed(false);
+  try
+  {
+    if (!req->module)
+    {
+      req->module = module_of(req);
+    }
+    auto object(req->module->object());
+    const bool cached(req->module->policy.ttl.count());
+    std::string hit;
+    if (cached && customsh::cache::get(req->queue, req->query.substr(req->offset), object, hit))
+    {
+      debug() << "cached" << req->query;
+      out->sputn(hit.data(), hit.size());
+      out->seal(reply_ok);
+      deliver(req, std::move(out));
+      return true;
+    }
+    if (req->module->policy.coalesce && !req->leading && attach(req))
+    {
+      debug() << "attached" << req->query;
+      req->deferred = true;
+      return true;
+    }
+    auto batch(req->module->batch());
+    if (batch && !req->collecting)
+    {
+      /* Set first, the collecting worker may answer it right away. */
+      req->deferred = true;
+      if (join(req))
+      {
+        debug() << "joined batch" << req->query;
+        return true;
+      }
+      req->deferred = false;
+    }
+    /* Nothing else needs the reply whole, it goes out as it is written.
+       Exclusive handlers are left out, they would hold their object while
+       the client takes its time. */
+    streamed = req->conn && !req->whole && req->conn->chunked() && !batch && !cached && !req->leading && req->module->mode == customsh::access::shared;
+    if (streamed && !req->conn->enstream(req))
+    {
+      debug() << "waiting to stream" << req->query;
+      return false;
+    }
+    if (object && !req->owned && !object->acquire(req, req->module->mode))
+    {
+      return false;
+    }
+    req->owned = object;
+    if (batch)
+    {
+      auto taken(collect(req));
+      std::vector<customsh::buffer_ptr> outs;
+      call_batch(taken, outs);
+      handoff(req);
+      for (std::size_t i(1); i < taken.size(); ++ i)
+        finish(taken[i], std::move(outs[i]));
+      /* Handed over by a previous batch, its connection waits like the others'. */
+      if (req->deferred)
+        finish(req, std::move(outs.front()));
+      else
+        deliver(req, std::move(outs.front()));
+      return true;
+    }
+    if (cached)
+      req->ticket = customsh::cache::ticket();
+    if (streamed)
+    {
+      out->stream(CHUNK_SIZE, [&req, &later, &cout](customsh::buffer_ptr chunk)
+      {
+        if (later)
+          return;
+        chunk->seal(reply_more);
+        chunk->tag(req->id);
+        if (!req->conn->stream(std::move(chunk)))
+          cout.setstate(std::ios::badbit);
+      });
     }
-    catch (const customsh::locked& ex)
+    info() << "call" << req->query;
     {
-      requests.put(req);
+      const std::function<customsh::deferred_ptr()> factory([&]()
+      {
+        if (!later)
+        {
+          /* Exclusive means until answered, not until the first suspension. */
+          if (req->owned && req->module->mode == customsh::access::exclusive)
+            req->holding.store(2, std::memory_order_release);
+          later = std::make_shared<deferred_reply>(req);
+        }
+        return later;
+      });
+      customsh::deferring scope(factory);
+      req->module->call(req->query.c_str() + std::min(req->query.size(), req->offset + req->module->prefix_size - 1), cout);
     }
+    cout.flush();
+    out->stream(0, nullptr);
+    out->seal(reply_ok);
+    if (cached && !later)
+      customsh::cache::put(req->queue, req->query.substr(req->offset), object, req->module->policy.ttl, out->data() + customsh::buffer::header_size, out->size() - customsh::buffer::header_size, req->ticket);
+  }
+  catch (const customsh::bad_argument& ex)
+  {
+    error() << "bad_argument";
+    if (later)
+      later->fail(ex);
+    out->reset();
+    out->seal(reply_bad_argument);
   }
+  catch (const customsh::not_found& ex)
+  {
+    error() << "not_found" << req->query;
+    if (later)
+      later->fail(ex);
+    out->reset();
+    out->seal(reply_not_found);
+  }
+  catch (const std::exception& ex)
+  {
+    /* A command that cannot start, a number out of range: the request
+       fails, the daemon carries on. */
+    error() << "failed" << req->query << ex.what();
+    if (later)
+      later->fail(ex);
+    out->reset();
+    out->seal(reply_failed);
+  }
+  if (later)
+  {
+    req->deferred = true;
+  }
+  else
+  {
+    detach(req, *out);
+    deliver(req, std::move(out));
+  }
+  if (streamed)
+  {
+    /* The next one of the connection streams in turn. */
+    auto next(req->conn->unstream());
+    if (next)
+      queue_of(next).put(next);
+  }
+  return true;
+}
+
+/* Queue the calling worker serves. */
+static thread_local customsh::queue<request_ptr>* worker_queue(nullptr);
+
+/// Resumes coroutine handlers on the workers they suspended on, and runs
+/// their calls to other modules as requests without a connection.
+struct worker_executor : public customsh::executor
+{
+  void* pool()
+  {
+    return worker_queue;
+  }
+  void post(void* pool, std::function<void()> work)
+  {
+    auto queue(pool ? static_cast<customsh::queue<request_ptr>*>(pool) : &requests);
+    queue->put(std::make_shared<request>(std::move(work)));
+  }
+  void submit(const std::string& query, customsh::deferred_ptr reply)
+  {
+    auto req(std::make_shared<request>(nullptr, query.data(), query.size()));
+    req->caller = std::move(reply);
+    dispatch(req);
+  }
+};
+
+static void worker(customsh::queue<request_ptr>* queue)
+{
+  worker_queue = queue;
+  std::vector<customsh::job_ptr> handed;
+  std::ostream cout(nullptr);
+  request_ptr req;
+  while (queue->get(req))
+  {
+    if (req->work)
+    {
+      req->work();
+      continue;
+    }
+    while (req && answer(req, cout))
+    {
+      if (req->holding.load(std::memory_order_acquire))
+      {
+        unhold(req);
+      }
+      else if (req->owned)
+      {
+        req->module->object()->release(req->module->mode, handed);
+      }
+      /* A deferred reply releases the connection itself once it is sent. */
+      auto next(req->deferred || !req->conn ? request_ptr() : req->conn->done());
+      if (handed.size())
+      {
+        /* The object now belongs to these, run the first one right away
+           when it is for this pool and let other workers pick up the rest. */
+        auto first(std::static_pointer_cast<request>(handed.front()));
+        const std::size_t here(&queue_of(first) == queue ? 1 : 0);
+        for (std::size_t i(here); i < handed.size(); ++ i)
+        {
+          auto other(std::static_pointer_cast<request>(handed[i]));
+          other->owned = true;
+          queue_of(other).put(other);
+        }
+        if (next)
+          dispatch(next);
+        req = here ? first : request_ptr();
+        if (req)
+          req->owned = true;
+        handed.clear();
+      }
+      else if (next)
+      {
+        /* The rest of a pipeline is answered by the same worker, unless it
+           is for another pool or a multi-command frame. */
+        route(next);
+        req = next;
+        if (next->multi || &queue_of(next) != queue)
+        {
+          dispatch(next);
+          req = nullptr;
+        }
+      }
+      else
+      {
+        req = nullptr;
+      }
+    }
+  }
+}
+
+/// A worker of `p`, in its namespace for as long as it runs.
+static void pinned(pool* p)
+{
+  ns::net in(p->netns);
+  customsh::cache::scope(&p->queue);
+  worker(&p->queue);
 }
 
 static int open_listener_unix(const char* path)
 {
-  int fd(socket(AF_UNIX, SOCK_STREAM, 0));
+  int fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
   if (fd >= 0)
   {
     sockaddr_un addr;
@@ -178,16 +1273,10 @@ static void set_non_blocking(int fd)
   }
 }
 
-static void set_blocking(int fd)
-{
-  int flags(fcntl(fd, F_GETFL, 0));
-  if (flags >= 0)
-  {
-    flags &= ~O_NONBLOCK;
-    fcntl(fd, F_SETFL, flags);
-  }
-}
-
+/// One reactor: accepts, reads and frames for the connections it owns, on its
+/// own epoll instance. Every reactor watches all listeners; EPOLLEXCLUSIVE
+/// wakes only one of them per incoming connection and a bounded accept batch
+/// leaves the rest of a burst to the others, so connections spread out.
 static void loop_event(const std::set<int>& listen_fd)
 {
   if (listen_fd.size() <= 0)
@@ -195,15 +1284,16 @@ static void loop_event(const std::set<int>& listen_fd)
     return;
   }
 
+  std::map<int, connection_ptr> connections;
   std::vector<epoll_event> events(1024);
-  auto epoll_fd(epoll_create1(0));
+  std::vector<request_ptr> ready;
+  auto epoll_fd(epoll_create1(EPOLL_CLOEXEC));
   epoll_event event;
 
   for (auto fd : listen_fd)
   {
     event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLET;
-    set_non_blocking(event.data.fd);
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event))
     {
       /// perror ("epoll_ctl");
@@ -217,20 +1307,18 @@ static void loop_event(const std::set<int>& listen_fd)
     for (decltype(n) i(0); i < n; ++ i)
     {
       auto& current(events.at(i));
-      if (false
-        ||  (current.events & (EPOLLERR | EPOLLHUP))
-        || !(current.events & EPOLLIN)
-      )
+      if (current.events & EPOLLERR)
       {
         /// fprintf (stderr, "epoll error\n");
-        close(current.data.fd);
-        buffers.erase(current.data.fd);
+        /* Listeners are shared by every reactor, only main() closes them. */
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, current.data.fd, nullptr);
+        connections.erase(current.data.fd);
       }
       else if (listen_fd.count(current.data.fd))
       {
-        while (true)
+        for (int accepted(0); accepted < ACCEPT_BATCH; ++ accepted)
         {
-          event.data.fd = accept(current.data.fd, nullptr, nullptr);
+          event.data.fd = accept4(current.data.fd, nullptr, nullptr, SOCK_CLOEXEC);
           if (event.data.fd == -1)
           {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -246,6 +1334,7 @@ static void loop_event(const std::set<int>& listen_fd)
           }
           event.events = EPOLLIN;
           set_non_blocking(event.data.fd);
+          connections[event.data.fd] = std::make_shared<connection>(int(event.data.fd), epoll_fd);
           if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event))
           {
             /// perror ("epoll_ctl");
@@ -255,58 +1344,399 @@ static void loop_event(const std::set<int>& listen_fd)
       }
       else
       {
-        while (true)
+        auto conn(connections.at(current.data.fd));
+        if (current.events & EPOLLOUT)
         {
-          char buffer[512];
+          if (conn->writable())
+          {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, current.data.fd, nullptr);
+            connections.erase(current.data.fd);
+            continue;
+          }
+          if (conn->resuming())
+          {
+            /* Frames held back at the cap, now that requests were answered. */
+            conn->load(nullptr, 0, ready);
+            for (const auto& req : ready)
+              dispatch(req);
+            ready.clear();
+          }
+        }
+        while ((current.events & (EPOLLIN | EPOLLHUP)) && !conn->throttled())
+        {
+          char buffer[4096];
           auto buffer_size(read(current.data.fd, buffer, sizeof buffer));
+          if (buffer_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          {
+            break;
+          }
           if (buffer_size <= 0)
           {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-              break;
-            close(current.data.fd);
-            buffers.erase(current.data.fd);
+            /* Requests already parsed are still answered, the connection goes once its output is drained. */
+            if (conn->shutdown())
+            {
+              epoll_ctl(epoll_fd, EPOLL_CTL_DEL, current.data.fd, nullptr);
+              connections.erase(current.data.fd);
+            }
             break;
           }
-          request_ptr req;
-          try
+          conn->load(buffer, buffer_size, ready);
+          for (const auto& req : ready)
+            dispatch(req);
+          ready.clear();
+        }
+      }
+    }
+  }
+  close(epoll_fd);
+}
+
+/// How workers wake a completion ring reactor: connections with something
+/// for it are queued, and the eventfd the ring keeps a read posted on is
+/// written once per batch. Shared with the connections, which can outlive
+/// the reactor at shutdown.
+struct ring_wakeup
+{
+  customsh::queue<connection_ptr> scheduled;
+  std::atomic<bool> signalled;
+  int fd;
+
+  ring_wakeup() : scheduled(4096), signalled(false), fd(eventfd(0, EFD_CLOEXEC)) { }
+  ~ring_wakeup()
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+  }
+  void notify(const connection_ptr& conn)
+  {
+    scheduled.put(conn);
+    if (!signalled.exchange(true))
+    {
+      const uint64_t one(1);
+      if (write(fd, &one, sizeof(one)) < 0)
+      {
+        /// perror ("eventfd");
+      }
+    }
+  }
+};
+
+enum : uint64_t
+{
+  ring_accept = 1,
+  ring_receive = 2,
+  ring_send = 3,
+  ring_wake = 4,
+  ring_cancel = 5,
+};
+
+/// Same job as `loop_event` on io_uring: a multishot accept per listener, a
+/// multishot receive per connection into buffers the kernel picks from a
+/// provided ring, and replies gathered into one SENDMSG per connection at a
+/// time. Everything is submitted in one batch per loop turn. Falls back to
+/// epoll when the kernel does not have what it needs.
+static void loop_uring(const std::set<int>& listen_fd)
+{
+  if (listen_fd.size() <= 0)
+  {
+    return;
+  }
+
+  std::unique_ptr<customsh::uring> uring;
+  try
+  {
+    uring.reset(new customsh::uring(1024, 1024, 4096));
+  }
+  catch (const std::system_error& e)
+  {
+    debug() << "io_uring:" << e.what();
+    return loop_event(listen_fd);
+  }
+  auto& ring(*uring);
+
+  struct slot
+  {
+    connection_ptr conn;
+    bool receiving = false;
+    /* The receive was cancelled, the connection being full. */
+    bool cancelling = false;
+    bool closed = false;
+    bool sending = false;
+    msghdr msg;
+    iovec iov[64];
+  };
+  /* A slot lives until neither a receive nor a send is in flight, so a completion never finds a reused fd. */
+  std::map<int, slot> slots;
+  std::vector<request_ptr> ready;
+  auto wakeup(std::make_shared<ring_wakeup>());
+  uint64_t wakeup_count;
+
+  auto accept([&](int fd)
+  {
+    auto sqe(ring.sqe());
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = ring_accept << 32 | uint32_t(fd);
+  });
+  auto receive([&](int fd, slot& s)
+  {
+    auto sqe(ring.sqe());
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = customsh::uring::buffer_group;
+    sqe->user_data = ring_receive << 32 | uint32_t(fd);
+    s.receiving = true;
+  });
+  /* Parses what the connection holds back, then stops or resumes receiving
+     with its room for requests. */
+  auto pace([&](int fd, slot& s)
+  {
+    s.conn->load(nullptr, 0, ready);
+    for (const auto& req : ready)
+      dispatch(req);
+    ready.clear();
+    if (!s.conn->throttled())
+    {
+      if (!s.receiving && !s.closed)
+        receive(fd, s);
+    }
+    else if (s.receiving && !s.cancelling)
+    {
+      auto sqe(ring.sqe());
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = ring_receive << 32 | uint32_t(fd);
+      sqe->user_data = ring_cancel << 32;
+      s.cancelling = true;
+    }
+  });
+  auto wait_wakeup([&]()
+  {
+    auto sqe(ring.sqe());
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakeup->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&wakeup_count);
+    sqe->len = sizeof(wakeup_count);
+    sqe->user_data = ring_wake << 32;
+  });
+  /* Sends what the connection has queued, or drops it once it is done with. */
+  auto kick([&](std::map<int, slot>::iterator i)
+  {
+    auto& s(i->second);
+    if (s.sending)
+    {
+      /* Given up on by stream(), the send may never complete otherwise. */
+      if (s.conn->closable())
+        ::shutdown(i->first, SHUT_RDWR);
+      return;
+    }
+    auto count(s.conn->gather(s.iov, sizeof(s.iov) / sizeof(*s.iov)));
+    /* Checked after gather(), from which on `done()` schedules it again. */
+    if (s.conn->resuming())
+      pace(i->first, s);
+    if (count)
+    {
+      std::memset(&s.msg, 0, sizeof(s.msg));
+      s.msg.msg_iov = s.iov;
+      s.msg.msg_iovlen = count;
+      auto sqe(ring.sqe());
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = i->first;
+      sqe->addr = reinterpret_cast<uint64_t>(&s.msg);
+      sqe->len = 1;
+      sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+      sqe->user_data = ring_send << 32 | uint32_t(i->first);
+      s.sending = true;
+    }
+    else if (s.conn->closable())
+    {
+      if (s.receiving)
+        ::shutdown(i->first, SHUT_RDWR);
+      else
+        slots.erase(i);
+    }
+  });
+
+  for (auto fd : listen_fd)
+    accept(fd);
+  wait_wakeup();
+
+  while (running)
+  {
+    ring.submit(1, 500);
+    ring.reap([&](const io_uring_cqe& cqe)
+    {
+      const int fd(uint32_t(cqe.user_data));
+      const bool more(cqe.flags & IORING_CQE_F_MORE);
+      switch (cqe.user_data >> 32)
+      {
+        case ring_accept:
+          if (cqe.res >= 0)
           {
-            req = buffers.at(current.data.fd);
+            auto& s(slots[cqe.res]);
+            s.conn = std::make_shared<connection>(int(cqe.res), [wakeup](const connection_ptr& conn) { wakeup->notify(conn); });
+            receive(cqe.res, s);
           }
-          catch (const std::out_of_range& ex)
+          if (!more)
+            accept(fd);
+          break;
+        case ring_receive:
+        {
+          auto i(slots.find(fd));
+          auto& s(i->second);
+          if (cqe.res > 0)
           {
-            req = std::make_shared<request>(int(current.data.fd));
-            buffers[current.data.fd] = req;
+            const uint16_t id(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            s.conn->load(ring.buffer(id), cqe.res, ready);
+            ring.recycle(id);
+            for (const auto& req : ready)
+              dispatch(req);
+            ready.clear();
+            if (more && s.conn->throttled())
+              pace(fd, s);
           }
-          if (req)
+          if (!more)
           {
-            if (req->load(buffer, buffer_size))
+            s.receiving = false;
+            s.cancelling = false;
+            if (cqe.res > 0 || cqe.res == -ENOBUFS || cqe.res == -ECANCELED)
             {
-              epoll_ctl(epoll_fd, EPOLL_CTL_DEL, current.data.fd, nullptr);
-              set_blocking(current.data.fd);
-              buffers.erase(current.data.fd);
-              requests.put(req);
-              break;
+              /* Left unarmed while full, `done()` schedules the connection. */
+              if (!s.conn->throttled())
+                receive(fd, s);
+            }
+            else
+            {
+              /* Requests already parsed are still answered, the connection goes once its output is drained. */
+              s.closed = true;
+              s.conn->shutdown();
+              kick(i);
             }
           }
+          break;
         }
+        case ring_send:
+        {
+          auto i(slots.find(fd));
+          i->second.sending = false;
+          i->second.conn->sent(cqe.res);
+          kick(i);
+          break;
+        }
+        case ring_wake:
+          wakeup->signalled = false;
+          wait_wakeup();
+          break;
+        case ring_cancel:
+          break;
       }
+    });
+    connection_ptr conn;
+    while (wakeup->scheduled.try_get(conn))
+    {
+      auto i(slots.find(conn->fd));
+      if (i != slots.end() && i->second.conn == conn)
+        kick(i);
     }
   }
 }
 
-int main()
+static int usage(const char* name)
+{
+  std::cerr << "Using: " << name << " [-u] [-s] [-r REACTORS] [-w WORKERS] [-l drop|block] [-c CACHE_MB] [-n NETNS[:WORKERS]]..." << std::endl;
+  return 1;
+}
+
+int main(int argc, char** argv)
 {
+  int reactor_count(REACTOR_COUNT);
+  int worker_count(WORKER_COUNT);
+  auto loop(loop_event);
+  bool spawner(false);
+  std::map<std::string, int> pinned_count;
+  for (int opt; (opt = getopt(argc, argv, "usr:w:l:c:n:")) != -1; )
+  {
+    switch (opt)
+    {
+      case 'u':
+        loop = loop_uring;
+        break;
+      case 's':
+        spawner = true;
+        break;
+      case 'r':
+        reactor_count = atoi(optarg);
+        break;
+      case 'w':
+        worker_count = atoi(optarg);
+        break;
+      case 'l':
+        if (!strcmp(optarg, "drop"))
+          customsh::logger::policy(customsh::overflow::drop);
+        else if (!strcmp(optarg, "block"))
+          customsh::logger::policy(customsh::overflow::block);
+        else
+          return usage(argv[0]);
+        break;
+      case 'c':
+        customsh::cache::capacity(std::size_t(atoi(optarg)) << 20);
+        break;
+      case 'n':
+      {
+        const std::string arg(optarg);
+        const auto colon(arg.find(':'));
+        const int count(colon == std::string::npos ? PINNED_COUNT : atoi(arg.c_str() + colon + 1));
+        if (count <= 0 || !colon)
+          return usage(argv[0]);
+        pinned_count[arg.substr(0, colon)] = count;
+        break;
+      }
+      default:
+        return usage(argv[0]);
+    }
+  }
+  if (optind != argc || reactor_count <= 0 || worker_count <= 0)
+    return usage(argv[0]);
+
   if (daemonized(termination))
     return 0;
 
+  /* Before any thread or connection exists, while the process is small. */
+  if (spawner && !sh::spawner::start())
+    error() << "spawner failed to start";
+
   std::set<int> listen_fd;
 
   customsh::modules::init();
+  static worker_executor executor;
+  customsh::executor::install(&executor);
 
   std::vector<std::thread> workers;
-  workers.reserve(WORKER_COUNT);
+  workers.reserve(worker_count);
   for (decltype(workers.capacity()) i(0); i < workers.capacity(); ++ i)
-    workers.emplace_back(worker);
+    workers.emplace_back(worker, &requests);
+
+  for (auto& netns : pinned_count)
+  {
+    try
+    {
+      ns::net probe(netns.first);
+    }
+    catch (const ns::exception& e)
+    {
+      error() << "cannot enter" << netns.first << e.what();
+      continue;
+    }
+    auto& p(pools[netns.first] = std::make_unique<pool>(netns.first));
+    for (int i(0); i < netns.second; ++ i)
+      p->threads.emplace_back(pinned, p.get());
+  }
 
   {
     ns::net ns("test");
@@ -323,10 +1753,25 @@ int main()
   else
   {
     debug() << "listen_fd" << listen_fd;
-    loop_event(listen_fd);
+    for (auto fd : listen_fd)
+      set_non_blocking(fd);
+    std::vector<std::thread> reactors;
+    reactors.reserve(reactor_count - 1);
+    for (decltype(reactors.capacity()) i(0); i < reactors.capacity(); ++ i)
+      reactors.emplace_back(loop, std::cref(listen_fd));
+    loop(listen_fd);
+    std::for_each(reactors.begin(), reactors.end(), std::mem_fn(&std::thread::join));
+    for (auto fd : listen_fd)
+      close(fd);
   }
 
+  requests.close();
   std::for_each(workers.begin(), workers.end(), std::mem_fn(&std::thread::join));
+  for (auto& p : pools)
+  {
+    p.second->queue.close();
+    std::for_each(p.second->threads.begin(), p.second->threads.end(), std::mem_fn(&std::thread::join));
+  }
 
   return 0;
 }
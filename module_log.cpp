@@ -0,0 +1,28 @@
+#include <iostream>
+#include "customsh.hpp"
+
+/// Built-in control of the log threshold: `log level <name>` changes it on
+/// the fly, `show log level` prints it. Levels compiled out stay out.
+class Log : public customsh::d
+{
+public:
+  Log()
+  {
+    bind("log level ", "(trace|debug|info|warning|error)", &Log::set_level);
+    bind_shared("show log level", &Log::show_level);
+  }
+  void set_level(const customsh::args& args, std::ostream& cout)
+  {
+    customsh::level value;
+    customsh::logger::parse(args.args[1], value);
+    customsh::logger::threshold(value);
+    show_level(args, cout);
+  }
+  void show_level(const customsh::args&, std::ostream& cout)
+  {
+    cout << "log level is " << customsh::logger::name(customsh::logger::threshold())
+      << ", compiled in from " << customsh::logger::name(customsh::level(CUSTOMSH_LOG_LEVEL));
+  }
+};
+
+volatile static Log instance;
@@ -0,0 +1,121 @@
+#include <net/if.h>
+#include <iostream>
+#include <map>
+#include "customsh.hpp"
+#include "netlink.hpp"
+
+/// Links and routes of the worker's network namespace over rtnetlink,
+/// without spawning `ip`. Prefix a query with "@netns " to reach another.
+/// Route changes arriving together are committed as one batch.
+class Net : public customsh::d
+{
+public:
+  Net()
+  {
+    trace;
+
+    bind_shared("show links", &Net::show_links);
+    bind("link ", "(\\S+) (up|down|mtu (\\d{2,5}))", &Net::link);
+    bind_batch("route ", "(add|replace|del) (\\S+)(?: via (\\S+))?(?: dev (\\S+))?", &Net::route, { .max = 256, .linger = std::chrono::milliseconds(1) });
+  }
+  ~Net()
+  {
+    trace;
+  }
+  /// What the kernel refused, as the status the client gets.
+  static std::exception_ptr refusal(int code)
+  {
+    error() << "rtnetlink:" << strerror(code);
+    if (code == ENOENT || code == ESRCH || code == ENODEV)
+      return std::make_exception_ptr(customsh::not_found());
+    return std::make_exception_ptr(customsh::bad_argument());
+  }
+  [[noreturn]] static void refused(const nl::exception& e)
+  {
+    std::rethrow_exception(refusal(e.code));
+  }
+  void show_links(const customsh::args&, std::ostream& cout)
+  {
+    try
+    {
+      nl::socket rtnl;
+      for (const auto& l : rtnl.links())
+        cout << l.index << ": " << l.name << " mtu " << l.mtu << ((l.flags & IFF_UP) ? " up" : " down") << '\n';
+    }
+    catch (const nl::exception& e)
+    {
+      refused(e);
+    }
+  }
+  void link(const customsh::args& args, std::ostream& cout)
+  {
+    try
+    {
+      nl::socket rtnl;
+      auto index(rtnl.index(args.args[1]));
+      if (!index)
+        throw customsh::not_found();
+      nl::batch b;
+      if (args.args[3].matched)
+        b.link_mtu(index, std::stoul(args.args[3].str()));
+      else
+        b.link_up(index, args.args[2].str() == "up");
+      rtnl.apply(b);
+      cout << args.args[1].str() << ' ' << args.args[2].str();
+    }
+    catch (const nl::exception& e)
+    {
+      refused(e);
+    }
+  }
+  /// Route changes queued together reach the kernel in one rtnetlink batch.
+  void route(std::vector<customsh::batched>& items)
+  {
+    try
+    {
+      nl::socket rtnl;
+      nl::batch b;
+      std::map<std::string, int> links;
+      /* Item of each request in `b`. */
+      std::vector<std::size_t> sent;
+      for (std::size_t i(0); i < items.size(); ++ i)
+      {
+        const auto& args(items[i].args);
+        const auto what(args.args[1].str());
+        try
+        {
+          nl::prefix dst(nl::prefix::parse(args.args[2])), via;
+          if (args.args[3].matched)
+            via = nl::prefix::parse(args.args[3]);
+          int oif(0);
+          if (args.args[4].matched)
+          {
+            auto link(links.find(args.args[4]));
+            if (link == links.end())
+              link = links.emplace(args.args[4], rtnl.index(args.args[4])).first;
+            if (!(oif = link->second))
+            {
+              items[i].failed = std::make_exception_ptr(customsh::not_found());
+              continue;
+            }
+          }
+          b.route(what == "add" ? nl::op::add : what == "replace" ? nl::op::replace : nl::op::del, dst, via, oif);
+          sent.push_back(i);
+          items[i].cout << "route " << what << ' ' << dst.str();
+        }
+        catch (const nl::exception& e)
+        {
+          items[i].failed = refusal(e.code);
+        }
+      }
+      for (const auto& failed : rtnl.commit(b))
+        items[sent[failed.first]].failed = refusal(failed.second);
+    }
+    catch (const nl::exception& e)
+    {
+      refused(e);
+    }
+  }
+};
+
+volatile static Net instance;
@@ -1,6 +1,8 @@
 #include <iostream>
 #include "customsh.hpp"
 #include "sh.hpp"
+#include "async.hpp"
+#include "await.hpp"
 
 class Test2 : public customsh::d
 {
@@ -19,11 +21,56 @@ public:
         debug() << line;
       }
     }
+    bind_shared("sleep ", "([0-9]+)", &Test2::sleep);
+    bind_shared("wait ", "([0-9]+) (.+)", &Test2::wait, { .coalesce = true });
+    bind_shared("show netns", &Test2::show_netns);
+    bind_shared("lines ", "(\\d{1,6})", &Test2::lines);
   }
   ~Test2()
   {
     trace;
   }
+  /// Answers once the command exits, the worker moves on meanwhile.
+  void sleep(const customsh::args& args, std::ostream&)
+  {
+    auto reply(customsh::defer());
+    try
+    {
+      sh::async({ "sleep", args.args[1] }, [reply](sh::result& res)
+      {
+        reply->send("slept, exit code " + std::to_string(res.code) + res.err);
+      });
+    }
+    catch (const std::system_error& e)
+    {
+      reply->send(e.what());
+    }
+  }
+  /// The network namespace of the worker answering, see `-n`.
+  void show_netns(const customsh::args&, std::ostream& cout)
+  {
+    char link[64];
+    const auto size(readlink("/proc/thread-self/ns/net", link, sizeof(link)));
+    cout << std::string(link, size > 0 ? size : 0);
+  }
+  /// N numbered lines, a large reply sent in chunks as it is written to
+  /// clients asking for them.
+  void lines(const customsh::args& args, std::ostream& cout)
+  {
+    const auto count(std::stoul(args.args[1].str()));
+    for (unsigned long i(0); i < count && cout; ++ i)
+      cout << "line " << i << '\n';
+  }
+  /// Waits N ms, answers the query and tells the kernel release, without
+  /// holding a thread in between.
+  customsh::task<std::string> wait(const customsh::args& args)
+  {
+    co_await customsh::sleep_for(std::chrono::milliseconds(std::stoul(args.args[1].str())));
+    auto reply(co_await customsh::call(args.args[2].str()));
+    const std::vector<std::string> argv { "uname", "-r" };
+    auto uname(co_await customsh::run(argv));
+    co_return reply + " on " + uname.out.substr(0, uname.out.find('\n'));
+  }
 };
 
 volatile static Test2 instance;
@@ -1,17 +1,33 @@
 #include <iostream>
+#include <map>
 #include "customsh.hpp"
 
 class Test3 : public customsh::d
 {
+  std::map<std::string, std::string> m_mtu;
 public:
   Test3()
   {
     trace;
+
+    bind("set mtu ", "([a-z]+\\d*(?:\\.\\d+)?) (\\d{2,5})", &Test3::mtu);
+    bind_shared("show mtu ", "([a-z]+\\d*(?:\\.\\d+)?)", &Test3::show_mtu, { .ttl = std::chrono::seconds(10), .coalesce = true });
   }
   ~Test3()
   {
     trace;
   }
+  void mtu(const customsh::args& args, std::ostream& cout)
+  {
+    m_mtu[args.args[1]] = args.args[2];
+    invalidate("show mtu " + args.args[1].str());
+    cout << "mtu of " << args.args[1].str() << " is " << args.args[2].str();
+  }
+  void show_mtu(const customsh::args& args, std::ostream& cout)
+  {
+    auto i(m_mtu.find(args.args[1]));
+    cout << "mtu of " << args.args[1].str() << " is " << (i == m_mtu.end() ? "unset" : i->second);
+  }
 };
 
 volatile static Test3 instance;
@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <linux/neighbour.h>
+
+#include <algorithm>
+
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK 10
+#endif
+
+#include "ns.hpp"
+#include "netlink.hpp"
+
+namespace nl
+{
+  namespace
+  {
+    /* Most bytes handed to one sendmsg(2), below the default send buffer. */
+    const std::size_t max_send = 64 << 10;
+    /* Receive buffer asked for, and what one queued ACK takes of it. */
+    const int receive_buffer = 4 << 20;
+    const int ack_cost = 1024;
+
+    uint16_t flags_of(op what)
+    {
+      switch (what)
+      {
+        case op::add:
+          return NLM_F_CREATE | NLM_F_EXCL;
+        case op::replace:
+          return NLM_F_CREATE | NLM_F_REPLACE;
+        default:
+          return 0;
+      }
+    }
+
+    int open_route(const std::string& netns)
+    {
+      try
+      {
+        ns::net in(netns);
+        return ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+      }
+      catch (const ns::exception& e)
+      {
+        throw exception(e.code);
+      }
+    }
+
+    std::size_t header_size(uint16_t type)
+    {
+      switch (type)
+      {
+        case RTM_GETLINK:
+          return sizeof(ifinfomsg);
+        case RTM_GETADDR:
+          return sizeof(ifaddrmsg);
+        case RTM_GETROUTE:
+          return sizeof(rtmsg);
+        case RTM_GETNEIGH:
+          return sizeof(ndmsg);
+        default:
+          return sizeof(rtgenmsg);
+      }
+    }
+  }
+
+  prefix prefix::parse(const std::string& text)
+  {
+    prefix parsed;
+    auto slash(text.find('/'));
+    auto ip(text.substr(0, slash));
+    if (inet_pton(AF_INET, ip.c_str(), parsed.bytes) == 1)
+      parsed.family = AF_INET;
+    else if (inet_pton(AF_INET6, ip.c_str(), parsed.bytes) == 1)
+      parsed.family = AF_INET6;
+    else
+      throw exception(EINVAL);
+    parsed.length = parsed.size() * 8;
+    if (slash != std::string::npos)
+    {
+      char* end;
+      auto length(strtoul(text.c_str() + slash + 1, &end, 10));
+      if (slash + 1 == text.size() || *end || length > parsed.length)
+        throw exception(EINVAL);
+      parsed.length = length;
+    }
+    return parsed;
+  }
+
+  std::string prefix::str() const
+  {
+    if (empty())
+      return std::string();
+    char text[INET6_ADDRSTRLEN];
+    inet_ntop(family, bytes, text, sizeof(text));
+    return std::string(text).append(1, '/').append(std::to_string(length));
+  }
+
+  void batch::append(const void* data, std::size_t size)
+  {
+    auto p(static_cast<const char*>(data));
+    m_data.insert(m_data.end(), p, p + size);
+    m_data.resize(NLMSG_ALIGN(m_data.size()));
+    reinterpret_cast<nlmsghdr*>(m_data.data() + m_offsets.back())->nlmsg_len = m_data.size() - m_offsets.back();
+  }
+
+  void batch::begin(uint16_t type, uint16_t flags, const void* header, std::size_t size)
+  {
+    nlmsghdr message {};
+    message.nlmsg_type = type;
+    message.nlmsg_flags = flags | NLM_F_REQUEST | NLM_F_ACK;
+    m_offsets.push_back(m_data.size());
+    append(&message, sizeof(message));
+    append(header, size);
+  }
+
+  void batch::attr(uint16_t type, const void* data, std::size_t size)
+  {
+    rtattr attribute { static_cast<unsigned short>(RTA_LENGTH(size)), type };
+    append(&attribute, sizeof(attribute));
+    append(data, size);
+  }
+
+  std::size_t batch::nest(uint16_t type)
+  {
+    auto offset(m_data.size());
+    rtattr attribute { RTA_LENGTH(0), static_cast<unsigned short>(type | NLA_F_NESTED) };
+    append(&attribute, sizeof(attribute));
+    return offset;
+  }
+
+  void batch::end(std::size_t offset)
+  {
+    reinterpret_cast<rtattr*>(m_data.data() + offset)->rta_len = m_data.size() - offset;
+  }
+
+  void batch::link_up(int index, bool up)
+  {
+    ifinfomsg header {};
+    header.ifi_index = index;
+    header.ifi_flags = up ? IFF_UP : 0;
+    header.ifi_change = IFF_UP;
+    begin(RTM_NEWLINK, 0, header);
+  }
+
+  void batch::link_mtu(int index, uint32_t mtu)
+  {
+    ifinfomsg header {};
+    header.ifi_index = index;
+    begin(RTM_NEWLINK, 0, header);
+    attr(IFLA_MTU, mtu);
+  }
+
+  void batch::address(op what, int index, const prefix& local)
+  {
+    ifaddrmsg header {};
+    header.ifa_family = local.family;
+    header.ifa_prefixlen = local.length;
+    header.ifa_index = index;
+    begin(what == op::del ? RTM_DELADDR : RTM_NEWADDR, flags_of(what), header);
+    attr(IFA_LOCAL, local);
+    attr(IFA_ADDRESS, local);
+  }
+
+  void batch::route(op what, const prefix& dst, const prefix& via, int oif, uint32_t table, uint32_t metric)
+  {
+    rtmsg header {};
+    header.rtm_family = dst.empty() ? via.family : dst.family;
+    header.rtm_dst_len = dst.length;
+    header.rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+    if (what == op::del)
+    {
+      header.rtm_scope = RT_SCOPE_NOWHERE;
+    }
+    else
+    {
+      header.rtm_protocol = RTPROT_STATIC;
+      header.rtm_scope = via.empty() ? RT_SCOPE_LINK : RT_SCOPE_UNIVERSE;
+      header.rtm_type = RTN_UNICAST;
+    }
+    begin(what == op::del ? RTM_DELROUTE : RTM_NEWROUTE, flags_of(what), header);
+    if (table >= 256)
+      attr(RTA_TABLE, table);
+    if (!dst.empty())
+      attr(RTA_DST, dst);
+    if (!via.empty())
+      attr(RTA_GATEWAY, via);
+    if (oif)
+      attr(RTA_OIF, uint32_t(oif));
+    if (metric)
+      attr(RTA_PRIORITY, metric);
+  }
+
+  void batch::neighbour(op what, int index, const prefix& ip, const unsigned char (&lladdr)[6])
+  {
+    ndmsg header {};
+    header.ndm_family = ip.family;
+    header.ndm_ifindex = index;
+    header.ndm_state = NUD_PERMANENT;
+    begin(what == op::del ? RTM_DELNEIGH : RTM_NEWNEIGH, flags_of(what), header);
+    attr(NDA_DST, ip);
+    if (what != op::del)
+      attr(NDA_LLADDR, lladdr, sizeof(lladdr));
+  }
+
+  socket::socket(const std::string& netns)
+    : m_fd(open_route(netns))
+    , m_seq(1)
+    , m_buffer(64 << 10)
+  {
+    if (m_fd < 0)
+    {
+      throw exception(errno);
+    }
+    /* Only root may go past net.core.rmem_max. */
+    if (setsockopt(m_fd, SOL_SOCKET, SO_RCVBUFFORCE, &receive_buffer, sizeof(receive_buffer)) < 0)
+      setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    int one(1);
+    setsockopt(m_fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+    sockaddr_nl local {};
+    local.nl_family = AF_NETLINK;
+    if (bind(m_fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0)
+    {
+      auto code(errno);
+      close(m_fd);
+      throw exception(code);
+    }
+  }
+
+  socket::~socket()
+  {
+    close(m_fd);
+  }
+
+  void socket::send(const void* data, std::size_t size)
+  {
+    sockaddr_nl kernel {};
+    kernel.nl_family = AF_NETLINK;
+    iovec iov { const_cast<void*>(data), size };
+    msghdr message {};
+    message.msg_name = &kernel;
+    message.msg_namelen = sizeof(kernel);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    while (sendmsg(m_fd, &message, 0) < 0)
+    {
+      if (errno != EINTR)
+        throw exception(errno);
+    }
+  }
+
+  std::size_t socket::receive()
+  {
+    while (true)
+    {
+      auto n(recv(m_fd, m_buffer.data(), m_buffer.size(), 0));
+      if (n >= 0)
+        return n;
+      if (errno != EINTR)
+        throw exception(errno);
+    }
+  }
+
+  std::vector<std::pair<std::size_t, int>> socket::commit(batch& b)
+  {
+    std::vector<std::pair<std::size_t, int>> failed;
+    int buffer(0);
+    socklen_t length(sizeof(buffer));
+    getsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &buffer, &length);
+    /* As many requests per sendmsg as the receive buffer holds ACKs of,
+       the kernel drops those that do not fit. */
+    const std::size_t window(std::max(buffer / ack_cost, 16));
+    const auto first(m_seq);
+    m_seq += b.size();
+
+    for (std::size_t i(0); i < b.size(); )
+    {
+      auto j(i);
+      std::size_t bytes(0);
+      for (; j < b.size() && j - i < window; ++ j)
+      {
+        auto message(reinterpret_cast<nlmsghdr*>(b.m_data.data() + b.m_offsets[j]));
+        if (j > i && bytes + message->nlmsg_len > max_send)
+          break;
+        message->nlmsg_seq = first + j;
+        bytes += message->nlmsg_len;
+      }
+      send(b.m_data.data() + b.m_offsets[i], bytes);
+
+      for (auto pending(j - i); pending > 0; )
+      {
+        int n(receive());
+        for (auto message(reinterpret_cast<const nlmsghdr*>(m_buffer.data())); NLMSG_OK(message, n); message = NLMSG_NEXT(message, n))
+        {
+          const std::size_t at(message->nlmsg_seq - first);
+          if (message->nlmsg_type != NLMSG_ERROR || at < i || at >= j)
+            continue;
+          auto error(static_cast<const nlmsgerr*>(NLMSG_DATA(message))->error);
+          if (error)
+            failed.emplace_back(at, -error);
+          -- pending;
+        }
+      }
+      i = j;
+    }
+    return failed;
+  }
+
+  void socket::apply(batch& b)
+  {
+    auto failed(commit(b));
+    if (failed.size() > 0)
+    {
+      throw exception(failed.front().second);
+    }
+  }
+
+  void socket::dump(uint16_t type, unsigned char family, const std::function<void(const nlmsghdr&)>& f)
+  {
+    struct
+    {
+      nlmsghdr header;
+      unsigned char family[NLMSG_ALIGN(sizeof(ifinfomsg))];
+    } request {};
+    request.header.nlmsg_len = NLMSG_LENGTH(header_size(type));
+    request.header.nlmsg_type = type;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = m_seq ++;
+    request.family[0] = family;
+    send(&request, request.header.nlmsg_len);
+
+    while (true)
+    {
+      int n(receive());
+      for (auto message(reinterpret_cast<const nlmsghdr*>(m_buffer.data())); NLMSG_OK(message, n); message = NLMSG_NEXT(message, n))
+      {
+        if (message->nlmsg_seq != request.header.nlmsg_seq)
+          continue;
+        if (message->nlmsg_type == NLMSG_DONE)
+          return;
+        if (message->nlmsg_type == NLMSG_ERROR)
+        {
+          throw exception(-static_cast<const nlmsgerr*>(NLMSG_DATA(message))->error);
+        }
+        f(*message);
+      }
+    }
+  }
+
+  std::vector<link> socket::links()
+  {
+    std::vector<link> found;
+    dump(RTM_GETLINK, AF_UNSPEC, [&found](const nlmsghdr& message)
+    {
+      if (message.nlmsg_type != RTM_NEWLINK)
+        return;
+      auto info(static_cast<const ifinfomsg*>(NLMSG_DATA(&message)));
+      link l { info->ifi_index, std::string(), 0, info->ifi_flags };
+      attributes(message, sizeof(ifinfomsg), [&l](uint16_t type, const void* data, std::size_t size)
+      {
+        if (type == IFLA_IFNAME && size > 0)
+          l.name.assign(static_cast<const char*>(data), strnlen(static_cast<const char*>(data), size));
+        else if (type == IFLA_MTU && size == sizeof(uint32_t))
+          memcpy(&l.mtu, data, sizeof(uint32_t));
+      });
+      found.push_back(std::move(l));
+    });
+    return found;
+  }
+
+  int socket::index(const std::string& name)
+  {
+    batch b;
+    b.begin(RTM_GETLINK, 0, ifinfomsg {});
+    b.attr(IFLA_IFNAME, name);
+    auto request(reinterpret_cast<nlmsghdr*>(b.m_data.data()));
+    request->nlmsg_seq = m_seq ++;
+    send(b.m_data.data(), b.m_data.size());
+
+    /* The link comes first, then the ACK. */
+    int found(0);
+    while (true)
+    {
+      int n(receive());
+      for (auto message(reinterpret_cast<const nlmsghdr*>(m_buffer.data())); NLMSG_OK(message, n); message = NLMSG_NEXT(message, n))
+      {
+        if (message->nlmsg_seq != request->nlmsg_seq)
+          continue;
+        if (message->nlmsg_type == RTM_NEWLINK)
+        {
+          found = static_cast<const ifinfomsg*>(NLMSG_DATA(message))->ifi_index;
+          continue;
+        }
+        if (message->nlmsg_type != NLMSG_ERROR)
+          continue;
+        auto error(-static_cast<const nlmsgerr*>(NLMSG_DATA(message))->error);
+        if (error == 0)
+          return found;
+        if (error == ENODEV)
+          return 0;
+        throw exception(error);
+      }
+    }
+  }
+
+  void attributes(const nlmsghdr& message, std::size_t header_size, const std::function<void(uint16_t, const void*, std::size_t)>& f)
+  {
+    auto offset(NLMSG_LENGTH(NLMSG_ALIGN(header_size)));
+    if (message.nlmsg_len < offset)
+      return;
+    int size(message.nlmsg_len - offset);
+    auto attribute(reinterpret_cast<const rtattr*>(reinterpret_cast<const char*>(&message) + offset));
+    for (; RTA_OK(attribute, size); attribute = RTA_NEXT(attribute, size))
+      f(attribute->rta_type & NLA_TYPE_MASK, RTA_DATA(attribute), RTA_PAYLOAD(attribute));
+  }
+}
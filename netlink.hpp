@@ -0,0 +1,139 @@
+#ifndef NETLINK_HPP
+#define NETLINK_HPP
+
+#include <string.h>
+#include <errno.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <exception>
+#include <functional>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+namespace nl
+{
+  struct exception : public std::exception
+  {
+    int code;
+    exception(int _code) : code(_code) { }
+    const char* what() const noexcept { return strerror(code); }
+  };
+
+  /// An IPv4 or IPv6 address with its prefix length, full length when the
+  /// text has none.
+  struct prefix
+  {
+    unsigned char family = 0;
+    unsigned char length = 0;
+    unsigned char bytes[16] = {};
+
+    /// Parses "10.0.0.1", "10.0.0.0/8" or "fd00::1/64", throws
+    /// `exception(EINVAL)` on anything else.
+    static prefix parse(const std::string& text);
+    inline bool empty() const { return family == 0; }
+    inline std::size_t size() const { return family == AF_INET6 ? 16 : 4; }
+    std::string str() const;
+  };
+
+  /// What a change does to an existing object.
+  enum class op
+  {
+    add,
+    replace,
+    del,
+  };
+
+  /// rtnetlink requests built back to back in one buffer, each asking for
+  /// an ACK, committed together by `socket::commit`.
+  class batch
+  {
+    std::vector<char> m_data;
+    std::vector<std::size_t> m_offsets;
+
+    friend class socket;
+    void append(const void* data, std::size_t size);
+
+  public:
+    /// Starts a request, `header` being its family header (ifinfomsg, ...).
+    /// Attributes added next go to it.
+    template<typename Header>
+    void begin(uint16_t type, uint16_t flags, const Header& header)
+    {
+      begin(type, flags, &header, sizeof(header));
+    }
+    void begin(uint16_t type, uint16_t flags, const void* header, std::size_t size);
+
+    void attr(uint16_t type, const void* data, std::size_t size);
+    inline void attr(uint16_t type, uint32_t value) { attr(type, &value, sizeof(value)); }
+    inline void attr(uint16_t type, const std::string& value) { attr(type, value.c_str(), value.size() + 1); }
+    inline void attr(uint16_t type, const prefix& value) { attr(type, value.bytes, value.size()); }
+    /// Opens a nested attribute, closed by `end(offset)` with what it returned.
+    std::size_t nest(uint16_t type);
+    void end(std::size_t offset);
+
+    /// Sets a link up or down.
+    void link_up(int index, bool up);
+    void link_mtu(int index, uint32_t mtu);
+    void address(op what, int index, const prefix& local);
+    /// A route to `dst` through gateway `via` and/or link `oif`, either may
+    /// be left empty or 0.
+    void route(op what, const prefix& dst, const prefix& via, int oif, uint32_t table = RT_TABLE_MAIN, uint32_t metric = 0);
+    /// A permanent neighbour entry, `lladdr` being a MAC address.
+    void neighbour(op what, int index, const prefix& ip, const unsigned char (&lladdr)[6]);
+
+    inline std::size_t size() const { return m_offsets.size(); }
+    inline void clear() { m_data.clear(); m_offsets.clear(); }
+  };
+
+  /// A link as `socket::links` lists it.
+  struct link
+  {
+    int index;
+    std::string name;
+    uint32_t mtu;
+    unsigned flags;
+  };
+
+  /// A NETLINK_ROUTE socket, bound to the network namespace it was opened
+  /// in for its whole life: a name under /run/netns, entered through the
+  /// fds `ns::net` keeps open, or the calling thread's. Not to be shared
+  /// between threads. Failures throw `exception`.
+  class socket
+  {
+    int m_fd;
+    uint32_t m_seq;
+    std::vector<char> m_buffer;
+
+    socket(const socket&) = delete;
+    socket& operator=(const socket&) = delete;
+
+    void send(const void* data, std::size_t size);
+    std::size_t receive();
+
+  public:
+    socket(const std::string& netns = std::string());
+    ~socket();
+
+    /// Sends every request of `b`, many per sendmsg(2), and collects their
+    /// ACKs. Returns the index and errno of those which failed.
+    std::vector<std::pair<std::size_t, int>> commit(batch& b);
+    /// Same, but throws the first error.
+    void apply(batch& b);
+
+    /// Calls `f` with every object a dump request of `type` (RTM_GETLINK,
+    /// RTM_GETROUTE, ...) returns, for address family `family`.
+    void dump(uint16_t type, unsigned char family, const std::function<void(const nlmsghdr&)>& f);
+    std::vector<link> links();
+    /// Index of link `name`, 0 when there is none.
+    int index(const std::string& name);
+  };
+
+  /// Calls `f(type, data, size)` for every attribute of `message` after its
+  /// family header of `header_size` bytes.
+  void attributes(const nlmsghdr& message, std::size_t header_size, const std::function<void(uint16_t, const void*, std::size_t)>& f);
+}
+
+#endif
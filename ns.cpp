@@ -3,6 +3,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
+#include <sys/inotify.h>
+
+#include <map>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
 
 #ifndef CLONE_NEWNET
 #define CLONE_NEWNET 0x40000000
@@ -16,56 +24,194 @@
 
 namespace ns
 {
-  static inline void switch_ns(const char* path, int nstype, int flags)
+  namespace
   {
-    int netns = open(path, O_RDONLY | O_CLOEXEC);
-    if (netns < 0)
+    const char netns_dir[] = "/run/netns";
+
+    /// An open namespace, closed with its last user.
+    struct handle
     {
-      throw exception(errno);
+      const int fd;
+      handle(int _fd) : fd(_fd) { }
+      ~handle() { close(fd); }
+    };
+
+    using handle_ptr = std::shared_ptr<const handle>;
+
+    handle_ptr open_ns(const char* path)
+    {
+      int fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+      {
+        throw exception(errno);
+      }
+      return std::make_shared<handle>(fd);
     }
-    if (setns(netns, nstype) < 0)
+
+    /// Named namespaces opened so far. Nothing is kept until the watch on
+    /// /run/netns is in place, it is retried on every miss until then.
+    class registry
     {
-      int _errno = errno;
-      close(netns);
-      throw exception(_errno);
+      std::shared_mutex m_mutex;
+      std::map<std::string, handle_ptr> m_open;
+      int m_inotify;
+      bool m_watching = false;
+
+    public:
+      /// The daemon's own namespaces, where `net` goes back to.
+      const handle_ptr root_net;
+      const handle_ptr root_mnt;
+
+      static registry& get()
+      {
+        static registry* instance(new registry());
+        return *instance;
+      }
+
+      handle_ptr find(const std::string& name)
+      {
+        {
+          std::shared_lock<std::shared_mutex> locker(m_mutex);
+          auto i(m_open.find(name));
+          if (i != m_open.end())
+            return i->second;
+        }
+        auto opened(open_ns(std::string(netns_dir).append(1, '/').append(name).c_str()));
+        std::unique_lock<std::shared_mutex> locker(m_mutex);
+        if (!m_watching && m_inotify >= 0)
+          m_watching = inotify_add_watch(m_inotify, netns_dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF) >= 0;
+        if (m_watching)
+          return m_open.emplace(name, opened).first->second;
+        return opened;
+      }
+
+      void forget(const std::string& name)
+      {
+        std::unique_lock<std::shared_mutex> locker(m_mutex);
+        m_open.erase(name);
+      }
+
+    private:
+      registry()
+        : m_inotify(inotify_init1(IN_CLOEXEC))
+        , root_net(open_ns("/proc/1/ns/net"))
+        , root_mnt(open_ns("/proc/self/ns/mnt"))
+      {
+        if (m_inotify >= 0)
+          std::thread(&registry::watch, this).detach();
+      }
+
+      [[noreturn]] void watch()
+      {
+        alignas(inotify_event) char events[4096];
+        while (true)
+        {
+          auto n(read(m_inotify, events, sizeof(events)));
+          if (n <= 0)
+            continue;
+          std::unique_lock<std::shared_mutex> locker(m_mutex);
+          for (auto p(events); p < events + n; )
+          {
+            auto event(reinterpret_cast<const inotify_event*>(p));
+            p += sizeof(inotify_event) + event->len;
+            if (event->len)
+            {
+              m_open.erase(event->name);
+              continue;
+            }
+            /* The directory itself went away, or events were lost. */
+            m_open.clear();
+            if (event->mask & IN_IGNORED)
+              m_watching = false;
+          }
+        }
+      }
+    };
+
+    /* What the `net` objects alive on this thread entered, innermost last. */
+    thread_local std::vector<handle_ptr> t_entered;
+
+    void enter(const handle_ptr& ns, int nstype)
+    {
+      if (setns(ns->fd, nstype) < 0)
+      {
+        throw exception(errno);
+      }
     }
-    close(netns);
-    if (unshare(flags) < 0)
+
+    handle_ptr enter(const char* netns)
     {
-      throw exception(errno);
+      auto& known(registry::get());
+      if (netns[0] == '/')
+      {
+        auto opened(open_ns(netns));
+        enter(opened, CLONE_NEWNET);
+        return opened;
+      }
+      try
+      {
+        auto found(known.find(netns));
+        enter(found, CLONE_NEWNET);
+        return found;
+      }
+      catch (const exception& e)
+      {
+        /* Caught between `ip netns add` creating the file and mounting over it. */
+        if (e.code != EINVAL)
+          throw;
+        known.forget(netns);
+        auto found(known.find(netns));
+        enter(found, CLONE_NEWNET);
+        return found;
+      }
     }
-  }
 
-  net::net(const char* netns)
-  {
-    if (netns[0] == '/')
+    /// Back to the namespace of the enclosing `net`, the daemon's without one.
+    void leave()
     {
-      switch_ns(netns, CLONE_NEWNET, CLONE_NEWNS);
+      auto& known(registry::get());
+      enter(t_entered.empty() ? known.root_net : t_entered.back(), CLONE_NEWNET);
     }
-    else
+  }
+
+  void net::init(const char* netns)
+  {
+    auto entered(enter(netns));
+    if (m_mount == mount::unshare && unshare(CLONE_NEWNS) < 0)
     {
-      switch_ns(std::string("/run/netns/").append(netns).c_str(), CLONE_NEWNET, CLONE_NEWNS);
+      auto code(errno);
+      leave();
+      throw exception(code);
     }
+    t_entered.push_back(std::move(entered));
+  }
+
+  net::net(const char* netns, mount _mount)
+    : m_mount(_mount)
+    , m_entered(true)
+  {
+    init(netns);
   }
 
-  net::net(const std::string& netns)
+  net::net(const std::string& netns, mount _mount)
+    : m_mount(netns.size() > 0 ? _mount : mount::keep)
+    , m_entered(netns.size() > 0)
   {
-    if (netns.size() > 0)
+    if (m_entered)
     {
-      if (netns.at(0) == '/')
-      {
-        switch_ns(netns.c_str(), CLONE_NEWNET, CLONE_NEWNS);
-      }
-      else
-      {
-        switch_ns(std::string("/run/netns/").append(netns).c_str(), CLONE_NEWNET, CLONE_NEWNS);
-      }
+      init(netns.c_str());
     }
   }
 
   net::~net()
   {
-    switch_ns("/proc/1/ns/net", CLONE_NEWNET, CLONE_NEWNS);
+    if (!m_entered)
+      return;
+    t_entered.pop_back();
+    leave();
+    if (m_mount == mount::unshare)
+    {
+      enter(registry::get().root_mnt, CLONE_NEWNS);
+    }
   }
 }
-
@@ -15,11 +15,31 @@ namespace ns
     const char* what() const noexcept { return strerror(code); }
   };
 
+  /// What `net` does with the calling thread's mount namespace.
+  enum class mount
+  {
+    /// Leaves it alone.
+    keep,
+    /// Gives the thread a private copy while it is in the network namespace,
+    /// as `ip netns exec` does, and puts it back in the daemon's on leaving.
+    unshare,
+  };
+
+  /// Moves the calling thread into a network namespace for its lifetime:
+  /// a name under /run/netns or an absolute path. Named namespaces are kept
+  /// open by a registry, so switching is a single setns(2) on a cached fd.
+  /// An inotify watch on /run/netns drops an entry once its namespace is
+  /// deleted or replaced. Leaving goes back to the namespace of the
+  /// enclosing `net` on the same thread, or to the daemon's. An empty name
+  /// stays where the thread is. Throws `exception` when the switch fails.
   class net
   {
+    mount m_mount;
+    bool m_entered;
+    void init(const char* netns);
   public:
-    net(const char* netns);
-    net(const std::string& netns);
+    net(const char* netns, mount _mount = mount::keep);
+    net(const std::string& netns, mount _mount = mount::keep);
     virtual ~net();
   };
 }
@@ -0,0 +1,934 @@
+#include <algorithm>
+#include <map>
+#include "pattern.hpp"
+
+namespace customsh
+{
+  namespace
+  {
+    /// Upper bound for the compiled program, `{n,m}` is expanded inline.
+    const std::size_t max_program_size = 1 << 16;
+
+    /// Capture offsets of all threads of one automaton state, kept on the
+    /// stack while matching.
+    const std::size_t max_automaton_slots = 512;
+
+    const int infinite = -1;
+
+    inline void charset_add(std::array<uint64_t, 4>& set, unsigned char c)
+    {
+      set[c >> 6] |= uint64_t(1) << (c & 63);
+    }
+
+    inline bool charset_has(const std::array<uint64_t, 4>& set, unsigned char c)
+    {
+      return set[c >> 6] & (uint64_t(1) << (c & 63));
+    }
+
+    inline bool is_word(unsigned char c)
+    {
+      return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+    }
+
+    inline bool is_digit(unsigned char c)
+    {
+      return c >= '0' && c <= '9';
+    }
+
+    inline bool is_space(unsigned char c)
+    {
+      return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    /// Per thread state of the matcher, only ever grows.
+    struct scratch
+    {
+      std::vector<uint32_t> pcs[2];
+      std::vector<int> caps[2];
+      std::vector<uint32_t> mark;
+      std::vector<int> current;
+      uint32_t generation = 0;
+      std::size_t count[2] = { 0, 0 };
+    };
+
+    thread_local scratch local;
+  }
+
+  constexpr uint32_t pattern::none;
+
+  class pattern::compiler
+  {
+    struct node
+    {
+      enum kind_t { empty, literal, set, any, concat, alternate, repeat, group, bol, eol, word, not_word } kind = empty;
+      unsigned char c = 0;
+      uint32_t index = 0;
+      int min = 0;
+      int max = 0;
+      bool greedy = true;
+      std::vector<node> children;
+    };
+
+    pattern& m_pattern;
+    const char* m_source;
+    const char* m_end;
+
+  public:
+    compiler(pattern& _pattern, const char* source, std::size_t source_size)
+      : m_pattern(_pattern)
+      , m_source(source)
+      , m_end(source + source_size)
+    {
+    }
+
+    void compile()
+    {
+      node whole;
+      whole.kind = node::group;
+      whole.index = 0;
+      whole.children.emplace_back(parse_alternate());
+      if (m_source != m_end)
+        throw bad_pattern();
+      if (m_pattern.m_groups > match::max_size)
+        throw bad_pattern();
+      emit(whole);
+      push(op_match);
+    }
+
+  private:
+    inline bool more() const { return m_source != m_end; }
+    inline char peek() const { return *m_source; }
+
+    node parse_alternate()
+    {
+      node first(parse_concat());
+      if (!more() || peek() != '|')
+        return first;
+      node alt;
+      alt.kind = node::alternate;
+      alt.children.emplace_back(std::move(first));
+      while (more() && peek() == '|')
+      {
+        ++ m_source;
+        alt.children.emplace_back(parse_concat());
+      }
+      return alt;
+    }
+
+    node parse_concat()
+    {
+      node cat;
+      cat.kind = node::concat;
+      while (more() && peek() != '|' && peek() != ')')
+        cat.children.emplace_back(parse_repeat());
+      if (cat.children.size() == 1)
+        return std::move(cat.children.front());
+      return cat;
+    }
+
+    bool parse_number(int& value)
+    {
+      if (!more() || !is_digit(peek()))
+        return false;
+      value = 0;
+      while (more() && is_digit(peek()))
+      {
+        value = value * 10 + (*m_source ++ - '0');
+        if (value > 1000)
+          throw bad_pattern();
+      }
+      return true;
+    }
+
+    /// Parses `{n}`, `{n,}` or `{n,m}`; a brace that does not start one of
+    /// those is left alone and taken as a literal, as ECMAScript does.
+    bool parse_braces(int& min, int& max)
+    {
+      auto start(m_source);
+      ++ m_source;
+      if (!parse_number(min))
+      {
+        m_source = start;
+        return false;
+      }
+      max = min;
+      if (more() && peek() == ',')
+      {
+        ++ m_source;
+        if (!parse_number(max))
+          max = infinite;
+      }
+      if (!more() || peek() != '}')
+      {
+        m_source = start;
+        return false;
+      }
+      ++ m_source;
+      if (max != infinite && max < min)
+        throw bad_pattern();
+      return true;
+    }
+
+    node parse_repeat()
+    {
+      node atom(parse_atom());
+      while (more())
+      {
+        int min, max;
+        switch (peek())
+        {
+        case '*': min = 0; max = infinite; ++ m_source; break;
+        case '+': min = 1; max = infinite; ++ m_source; break;
+        case '?': min = 0; max = 1; ++ m_source; break;
+        case '{':
+          if (parse_braces(min, max))
+            break;
+          return atom;
+        default:
+          return atom;
+        }
+        if (atom.kind == node::bol || atom.kind == node::eol || atom.kind == node::word || atom.kind == node::not_word)
+          throw bad_pattern();
+        node rep;
+        rep.kind = node::repeat;
+        rep.min = min;
+        rep.max = max;
+        if (more() && peek() == '?')
+        {
+          rep.greedy = false;
+          ++ m_source;
+        }
+        rep.children.emplace_back(std::move(atom));
+        atom = std::move(rep);
+      }
+      return atom;
+    }
+
+    node make_set(const charset& set)
+    {
+      node n;
+      n.kind = node::set;
+      n.index = m_pattern.m_classes.size();
+      m_pattern.m_classes.emplace_back(set);
+      return n;
+    }
+
+    /// Character class escapes shared by atoms and `[...]`.
+    bool class_escape(char e, charset& set)
+    {
+      bool (*test)(unsigned char);
+      switch (e)
+      {
+      case 'd': case 'D': test = is_digit; break;
+      case 'w': case 'W': test = is_word; break;
+      case 's': case 'S': test = is_space; break;
+      default: return false;
+      }
+      const bool negate(e == 'D' || e == 'W' || e == 'S');
+      for (unsigned c(0); c < 256; ++ c)
+        if (test(c) != negate)
+          charset_add(set, c);
+      return true;
+    }
+
+    unsigned char char_escape(char e)
+    {
+      switch (e)
+      {
+      case 'n': return '\n';
+      case 'r': return '\r';
+      case 't': return '\t';
+      case 'f': return '\f';
+      case 'v': return '\v';
+      case '0': return '\0';
+      case 'x':
+        {
+          unsigned value(0);
+          for (int i(0); i < 2; ++ i)
+          {
+            if (!more())
+              throw bad_pattern();
+            const char h(*m_source ++);
+            if (h >= '0' && h <= '9') value = value * 16 + (h - '0');
+            else if (h >= 'a' && h <= 'f') value = value * 16 + (h - 'a' + 10);
+            else if (h >= 'A' && h <= 'F') value = value * 16 + (h - 'A' + 10);
+            else throw bad_pattern();
+          }
+          return value;
+        }
+      default:
+        /// Back references, unicode and control escapes are not supported.
+        if (is_word(e))
+          throw bad_pattern();
+        return e;
+      }
+    }
+
+    node parse_class()
+    {
+      charset set = { { 0, 0, 0, 0 } };
+      bool negate(false);
+      if (more() && peek() == '^')
+      {
+        negate = true;
+        ++ m_source;
+      }
+      bool first(true);
+      while (true)
+      {
+        if (!more())
+          throw bad_pattern();
+        char c(*m_source ++);
+        if (c == ']' && !first)
+          break;
+        first = false;
+        unsigned char low(c);
+        if (c == '\\')
+        {
+          if (!more())
+            throw bad_pattern();
+          const char e(*m_source ++);
+          if (class_escape(e, set))
+            continue;
+          low = e == 'b' ? '\b' : char_escape(e);
+        }
+        unsigned char high(low);
+        if (m_end - m_source >= 2 && peek() == '-' && m_source[1] != ']')
+        {
+          ++ m_source;
+          char h(*m_source ++);
+          if (h == '\\')
+          {
+            if (!more())
+              throw bad_pattern();
+            h = char_escape(*m_source ++);
+          }
+          high = h;
+          if (high < low)
+            throw bad_pattern();
+        }
+        for (unsigned i(low); i <= high; ++ i)
+          charset_add(set, i);
+      }
+      if (negate)
+        for (auto& word : set)
+          word = ~word;
+      return make_set(set);
+    }
+
+    node parse_atom()
+    {
+      node n;
+      const char c(*m_source ++);
+      switch (c)
+      {
+      case '(':
+        if (m_end - m_source >= 2 && m_source[0] == '?')
+        {
+          if (m_source[1] != ':')
+            throw bad_pattern();
+          m_source += 2;
+          n = parse_alternate();
+        }
+        else
+        {
+          n.kind = node::group;
+          n.index = m_pattern.m_groups ++;
+          n.children.emplace_back(parse_alternate());
+        }
+        if (!more() || peek() != ')')
+          throw bad_pattern();
+        ++ m_source;
+        return n;
+      case '[':
+        return parse_class();
+      case '.':
+        n.kind = node::any;
+        return n;
+      case '^':
+        n.kind = node::bol;
+        return n;
+      case '$':
+        n.kind = node::eol;
+        return n;
+      case '*':
+      case '+':
+      case '?':
+        throw bad_pattern();
+      case '\\':
+        {
+          if (!more())
+            throw bad_pattern();
+          const char e(*m_source ++);
+          if (e == 'b' || e == 'B')
+          {
+            n.kind = e == 'b' ? node::word : node::not_word;
+            return n;
+          }
+          charset set = { { 0, 0, 0, 0 } };
+          if (class_escape(e, set))
+            return make_set(set);
+          n.kind = node::literal;
+          n.c = char_escape(e);
+          return n;
+        }
+      default:
+        n.kind = node::literal;
+        n.c = c;
+        return n;
+      }
+    }
+
+    uint32_t push(opcode op, uint32_t x = 0, uint32_t y = 0, unsigned char c = 0)
+    {
+      if (m_pattern.m_program.size() >= max_program_size)
+        throw bad_pattern();
+      m_pattern.m_program.push_back({ op, c, x, y });
+      return m_pattern.m_program.size() - 1;
+    }
+
+    inline uint32_t here() const { return m_pattern.m_program.size(); }
+
+    /// Greedy repeats prefer entering the body, lazy ones skipping it.
+    void patch_split(uint32_t at, uint32_t taken, uint32_t skipped, bool greedy)
+    {
+      m_pattern.m_program[at].x = greedy ? taken : skipped;
+      m_pattern.m_program[at].y = greedy ? skipped : taken;
+    }
+
+    void emit(const node& n)
+    {
+      switch (n.kind)
+      {
+      case node::empty:
+        break;
+      case node::literal:
+        push(op_char, 0, 0, n.c);
+        break;
+      case node::set:
+        push(op_class, n.index);
+        break;
+      case node::any:
+        push(op_any);
+        break;
+      case node::bol:
+        push(op_bol);
+        break;
+      case node::eol:
+        push(op_eol);
+        break;
+      case node::word:
+        push(op_word);
+        break;
+      case node::not_word:
+        push(op_not_word);
+        break;
+      case node::concat:
+        for (auto& child : n.children)
+          emit(child);
+        break;
+      case node::group:
+        push(op_save, n.index * 2);
+        emit(n.children.front());
+        push(op_save, n.index * 2 + 1);
+        break;
+      case node::alternate:
+        {
+          std::vector<uint32_t> exits;
+          for (std::size_t i(0); i + 1 < n.children.size(); ++ i)
+          {
+            const auto split(push(op_split));
+            emit(n.children[i]);
+            exits.emplace_back(push(op_jmp));
+            m_pattern.m_program[split].x = split + 1;
+            m_pattern.m_program[split].y = here();
+          }
+          emit(n.children.back());
+          for (auto exit : exits)
+            m_pattern.m_program[exit].x = here();
+        }
+        break;
+      case node::repeat:
+        {
+          const auto& body(n.children.front());
+          for (int i(0); i < n.min; ++ i)
+            emit(body);
+          if (n.max == infinite)
+          {
+            const auto loop(push(op_split));
+            emit(body);
+            push(op_jmp, loop);
+            patch_split(loop, loop + 1, here(), n.greedy);
+          }
+          else
+          {
+            std::vector<uint32_t> splits;
+            for (int i(n.min); i < n.max; ++ i)
+            {
+              splits.emplace_back(push(op_split));
+              emit(body);
+            }
+            for (auto split : splits)
+              patch_split(split, split + 1, here(), n.greedy);
+          }
+        }
+        break;
+      }
+    }
+  };
+
+  /// Subset construction over the program that keeps thread priority and
+  /// records capture slot updates on the transitions.
+  class pattern::automaton
+  {
+    struct entry
+    {
+      uint32_t pc;
+      std::vector<uint32_t> saves;
+    };
+    struct unsupported { };
+
+    /// Upper bounds past which the NFA is used as is.
+    static const std::size_t max_states = 2048;
+    static const std::size_t max_steps = 1 << 18;
+
+    pattern& m_pattern;
+    std::map<std::vector<uint32_t>, uint32_t> m_index;
+    std::vector<std::vector<uint32_t>> m_threads;
+    std::vector<bool> m_visited;
+    std::vector<uint32_t> m_path;
+
+  public:
+    automaton(pattern& _pattern) : m_pattern(_pattern) { }
+
+    void build()
+    {
+      try
+      {
+        classify();
+        m_visited.assign(m_pattern.m_program.size(), false);
+        std::vector<entry> entries;
+        closure(0, true, false, entries);
+        m_pattern.m_start = transition_to(entries, std::vector<uint32_t>(entries.size(), none), true);
+        for (std::size_t s(0); s < m_threads.size(); ++ s)
+        {
+          for (std::size_t k(0); k < m_pattern.m_class_count; ++ k)
+          {
+            const auto t(next(s, k));
+            m_pattern.m_transitions[s * m_pattern.m_class_count + k] = t;
+          }
+          accept(s);
+        }
+      }
+      catch (const unsupported&)
+      {
+        m_pattern.m_states.clear();
+        m_pattern.m_transitions.clear();
+        m_pattern.m_steps.clear();
+        m_pattern.m_saves.clear();
+        m_pattern.m_start = { none, 0, 0, false };
+      }
+    }
+
+  private:
+    bool consumes(const inst& i, unsigned char c) const
+    {
+      switch (i.op)
+      {
+      case op_char: return i.c == c;
+      case op_any: return c != '\n' && c != '\r';
+      case op_class: return charset_has(m_pattern.m_classes[i.x], c);
+      default: return false;
+      }
+    }
+
+    /// Bytes no instruction can tell apart share a column of the table.
+    void classify()
+    {
+      std::map<std::vector<bool>, uint8_t> signatures;
+      for (unsigned c(0); c < 256; ++ c)
+      {
+        std::vector<bool> signature;
+        for (auto& i : m_pattern.m_program)
+          if (i.op == op_char || i.op == op_any || i.op == op_class)
+            signature.push_back(consumes(i, c));
+        auto found(signatures.emplace(signature, signatures.size()));
+        m_pattern.m_byte_class[c] = found.first->second;
+      }
+      m_pattern.m_class_count = signatures.size();
+    }
+
+    void closure(uint32_t pc, bool at_start, bool at_end, std::vector<entry>& out)
+    {
+      if (m_visited[pc])
+        return;
+      m_visited[pc] = true;
+      const auto& i(m_pattern.m_program[pc]);
+      switch (i.op)
+      {
+      case op_jmp:
+        closure(i.x, at_start, at_end, out);
+        break;
+      case op_split:
+        closure(i.x, at_start, at_end, out);
+        closure(i.y, at_start, at_end, out);
+        break;
+      case op_save:
+        m_path.push_back(i.x);
+        closure(pc + 1, at_start, at_end, out);
+        m_path.pop_back();
+        break;
+      case op_bol:
+        if (at_start)
+          closure(pc + 1, at_start, at_end, out);
+        break;
+      case op_eol:
+        if (at_end)
+          closure(pc + 1, at_start, at_end, out);
+        else
+          out.push_back({ pc, m_path });
+        break;
+      case op_word:
+      case op_not_word:
+        throw unsupported();
+      default:
+        out.push_back({ pc, m_path });
+        break;
+      }
+    }
+
+    uint32_t push_saves(const std::vector<uint32_t>& saves)
+    {
+      const uint32_t first(m_pattern.m_saves.size());
+      m_pattern.m_saves.insert(m_pattern.m_saves.end(), saves.begin(), saves.end());
+      return first;
+    }
+
+    transition transition_to(const std::vector<entry>& entries, const std::vector<uint32_t>& from, bool initial)
+    {
+      if (entries.empty())
+        return { none, 0, 0, false };
+      std::vector<uint32_t> key;
+      key.reserve(entries.size() + 1);
+      for (auto& e : entries)
+        key.push_back(e.pc);
+      if (initial)
+        key.push_back(none);
+      auto found(m_index.find(key));
+      uint32_t target;
+      if (found != m_index.end())
+      {
+        target = found->second;
+      }
+      else
+      {
+        if (m_threads.size() >= max_states)
+          throw unsupported();
+        target = m_threads.size();
+        m_index.emplace(key, target);
+        if (initial)
+          key.pop_back();
+        m_threads.emplace_back(key);
+        m_pattern.m_states.push_back({ uint32_t(entries.size()), none, { none, 0, 0 } });
+        m_pattern.m_transitions.resize(m_threads.size() * m_pattern.m_class_count);
+        m_pattern.m_max_threads = std::max(m_pattern.m_max_threads, entries.size());
+        if (m_pattern.m_max_threads * m_pattern.m_groups * 2 > max_automaton_slots)
+          throw unsupported();
+      }
+      transition t = { target, uint32_t(m_pattern.m_steps.size()), uint32_t(entries.size()), true };
+      if (m_pattern.m_steps.size() + entries.size() > max_steps)
+        throw unsupported();
+      for (std::size_t n(0); n < entries.size(); ++ n)
+      {
+        m_pattern.m_steps.push_back({ from[n], push_saves(entries[n].saves), uint32_t(entries[n].saves.size()) });
+        if (from[n] != n)
+          t.in_place = false;
+      }
+      return t;
+    }
+
+    transition next(std::size_t s, std::size_t k)
+    {
+      unsigned c(0);
+      while (m_pattern.m_byte_class[c] != k)
+        ++ c;
+      std::fill(m_visited.begin(), m_visited.end(), false);
+      std::vector<entry> entries;
+      std::vector<uint32_t> from;
+      const auto threads(m_threads[s]);
+      for (uint32_t t(0); t < threads.size(); ++ t)
+      {
+        if (!consumes(m_pattern.m_program[threads[t]], c))
+          continue;
+        closure(threads[t] + 1, false, false, entries);
+        from.resize(entries.size(), t);
+      }
+      return transition_to(entries, from, false);
+    }
+
+    /// The first thread, by priority, that reaches `match` at the end of the
+    /// query, and the slots it still sets on the way there.
+    void accept(std::size_t s)
+    {
+      const bool initial(s == m_pattern.m_start.next);
+      const auto threads(m_threads[s]);
+      for (uint32_t t(0); t < threads.size(); ++ t)
+      {
+        const auto& i(m_pattern.m_program[threads[t]]);
+        if (i.op == op_match)
+        {
+          m_pattern.m_states[s].accept = t;
+          m_pattern.m_states[s].accept_step = { t, 0, 0 };
+          return;
+        }
+        if (i.op != op_eol)
+          continue;
+        std::fill(m_visited.begin(), m_visited.end(), false);
+        std::vector<entry> entries;
+        closure(threads[t] + 1, initial, true, entries);
+        for (auto& e : entries)
+        {
+          if (m_pattern.m_program[e.pc].op == op_match)
+          {
+            m_pattern.m_states[s].accept = t;
+            m_pattern.m_states[s].accept_step = { t, push_saves(e.saves), uint32_t(e.saves.size()) };
+            return;
+          }
+        }
+      }
+    }
+  };
+
+  pattern::pattern(const char* source, std::size_t source_size)
+  {
+    compiler(*this, source, source_size).compile();
+    automaton(*this).build();
+  }
+
+  bool pattern::matches(const char* query, std::size_t query_size, match& m) const
+  {
+    if (m_states.size())
+      return run_automaton(query, query_size, m);
+    return run_program(query, query_size, m);
+  }
+
+  bool pattern::run_automaton(const char* query, std::size_t query_size, match& m) const
+  {
+    m.m_size = 0;
+    if (m_start.next == none)
+      return false;
+    const std::size_t slots(m_groups * 2);
+    std::array<int, max_automaton_slots * 2> buffer;
+    int* current(buffer.data());
+    int* next(buffer.data() + max_automaton_slots);
+    const step* const steps(m_steps.data());
+    const uint32_t* const saves(m_saves.data());
+
+    auto apply([&](const transition& t, int pos)
+    {
+      const step* step(steps + t.first);
+      if (t.in_place)
+      {
+        for (uint32_t n(0); n < t.threads; ++ n, ++ step)
+          for (uint32_t i(0); i < step->count; ++ i)
+            current[n * slots + saves[step->first + i]] = pos;
+        return;
+      }
+      for (uint32_t n(0); n < t.threads; ++ n, ++ step)
+      {
+        int* caps(next + n * slots);
+        if (step->from == none)
+        {
+          for (std::size_t i(0); i < slots; ++ i)
+            caps[i] = -1;
+        }
+        else
+        {
+          const int* from(current + step->from * slots);
+          for (std::size_t i(0); i < slots; ++ i)
+            caps[i] = from[i];
+        }
+        for (uint32_t i(0); i < step->count; ++ i)
+          caps[saves[step->first + i]] = pos;
+      }
+      std::swap(current, next);
+    });
+
+    apply(m_start, 0);
+    uint32_t state(m_start.next);
+    const transition* const transitions(m_transitions.data());
+    for (std::size_t pos(0); pos < query_size; ++ pos)
+    {
+      const auto& t(transitions[state * m_class_count + m_byte_class[(unsigned char)query[pos]]]);
+      if (t.next == none)
+        return false;
+      apply(t, pos + 1);
+      state = t.next;
+    }
+
+    const auto& final(m_states[state]);
+    if (final.accept == none)
+      return false;
+    int* caps(current + final.accept * slots);
+    for (uint32_t i(0); i < final.accept_step.count; ++ i)
+      caps[saves[final.accept_step.first + i]] = query_size;
+    m.m_size = m_groups;
+    for (std::size_t g(0); g < m_groups; ++ g)
+    {
+      auto& sub(m.m_groups[g]);
+      sub.matched = caps[g * 2] >= 0 && caps[g * 2 + 1] >= 0;
+      sub.first = sub.matched ? query + caps[g * 2] : query + query_size;
+      sub.second = sub.matched ? query + caps[g * 2 + 1] : query + query_size;
+    }
+    return true;
+  }
+
+  bool pattern::run_program(const char* query, std::size_t query_size, match& m) const
+  {
+    const std::size_t slots(m_groups * 2);
+    const std::size_t size(m_program.size());
+    auto& s(local);
+    for (int l(0); l < 2; ++ l)
+    {
+      if (s.pcs[l].size() < size)
+        s.pcs[l].resize(size);
+      if (s.caps[l].size() < size * slots)
+        s.caps[l].resize(size * slots);
+    }
+    if (s.mark.size() < size)
+      s.mark.resize(size, 0);
+    if (s.current.size() < slots)
+      s.current.resize(slots);
+
+    std::size_t pos(0);
+
+    /// Follows non consuming instructions from `pc` and records every thread
+    /// that stops on a consuming one, in priority order.
+    struct
+    {
+      const pattern* self;
+      scratch* s;
+      const char* query;
+      std::size_t query_size;
+      std::size_t slots;
+
+      void operator()(int list, uint32_t pc, std::size_t pos)
+      {
+        if (s->mark[pc] == s->generation)
+          return;
+        s->mark[pc] = s->generation;
+        const auto& i(self->m_program[pc]);
+        switch (i.op)
+        {
+        case op_jmp:
+          (*this)(list, i.x, pos);
+          return;
+        case op_split:
+          (*this)(list, i.x, pos);
+          (*this)(list, i.y, pos);
+          return;
+        case op_save:
+          {
+            const auto old(s->current[i.x]);
+            s->current[i.x] = pos;
+            (*this)(list, pc + 1, pos);
+            s->current[i.x] = old;
+          }
+          return;
+        case op_bol:
+          if (pos == 0)
+            (*this)(list, pc + 1, pos);
+          return;
+        case op_eol:
+          if (pos == query_size)
+            (*this)(list, pc + 1, pos);
+          return;
+        case op_word:
+        case op_not_word:
+          {
+            const bool before(pos > 0 && is_word(query[pos - 1]));
+            const bool after(pos < query_size && is_word(query[pos]));
+            if ((before != after) == (i.op == op_word))
+              (*this)(list, pc + 1, pos);
+          }
+          return;
+        default:
+          {
+            auto& n(s->count[list]);
+            s->pcs[list][n] = pc;
+            std::copy(s->current.begin(), s->current.begin() + slots, s->caps[list].begin() + n * slots);
+            ++ n;
+          }
+          return;
+        }
+      }
+    } add = { this, &s, query, query_size, slots };
+
+    int current(0);
+    s.count[0] = s.count[1] = 0;
+    std::fill(s.current.begin(), s.current.begin() + slots, -1);
+    if (++ s.generation == 0)
+    {
+      std::fill(s.mark.begin(), s.mark.end(), 0);
+      s.generation = 1;
+    }
+    add(current, 0, pos);
+
+    for (; s.count[current]; ++ pos)
+    {
+      const int next(current ^ 1);
+      s.count[next] = 0;
+      if (++ s.generation == 0)
+      {
+        std::fill(s.mark.begin(), s.mark.end(), 0);
+        s.generation = 1;
+      }
+      const unsigned char c(pos < query_size ? query[pos] : 0);
+      for (std::size_t t(0); t < s.count[current]; ++ t)
+      {
+        const auto pc(s.pcs[current][t]);
+        const auto& i(m_program[pc]);
+        const int* caps(s.caps[current].data() + t * slots);
+        bool step(false);
+        switch (i.op)
+        {
+        case op_match:
+          if (pos == query_size)
+          {
+            m.m_size = m_groups;
+            for (std::size_t g(0); g < m_groups; ++ g)
+            {
+              auto& sub(m.m_groups[g]);
+              sub.matched = caps[g * 2] >= 0 && caps[g * 2 + 1] >= 0;
+              sub.first = sub.matched ? query + caps[g * 2] : query + query_size;
+              sub.second = sub.matched ? query + caps[g * 2 + 1] : query + query_size;
+            }
+            return true;
+          }
+          break;
+        case op_char:
+          step = pos < query_size && c == i.c;
+          break;
+        case op_any:
+          step = pos < query_size && c != '\n' && c != '\r';
+          break;
+        case op_class:
+          step = pos < query_size && charset_has(m_classes[i.x], c);
+          break;
+        default:
+          break;
+        }
+        if (step)
+        {
+          std::copy(caps, caps + slots, s.current.begin());
+          add(next, pc + 1, pos + 1);
+        }
+      }
+      current = next;
+      if (pos >= query_size)
+        break;
+    }
+    m.m_size = 0;
+    return false;
+  }
+}
@@ -0,0 +1,162 @@
+#ifndef PATTERN_HPP
+#define PATTERN_HPP
+
+#include <array>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <exception>
+
+namespace customsh
+{
+  class bad_pattern : public std::exception
+  {
+  public:
+    bad_pattern() { }
+  };
+
+  /// One capture group of a `match`, mirrors the part of `std::ssub_match`
+  /// the handlers use. Points into the matched query.
+  struct submatch
+  {
+    const char* first = nullptr;
+    const char* second = nullptr;
+    bool matched = false;
+
+    inline std::size_t length() const { return matched ? second - first : 0; }
+    inline std::string str() const { return matched ? std::string(first, second) : std::string(); }
+    inline operator std::string() const { return str(); }
+  };
+
+  /// Capture groups of a full match, group 0 being the whole query. Has a
+  /// fixed capacity so matching never allocates.
+  class match
+  {
+  public:
+    static constexpr std::size_t max_size = 16;
+
+    inline std::size_t size() const { return m_size; }
+    inline bool empty() const { return !m_size; }
+    inline const submatch& operator[](std::size_t n) const { return n < m_size ? m_groups[n] : m_unmatched; }
+    inline std::string str(std::size_t n = 0) const { return (*this)[n].str(); }
+    inline std::size_t length(std::size_t n = 0) const { return (*this)[n].length(); }
+    /// Points the captures into `to`, a copy of the query they were found in.
+    inline void rebase(const char* from, const char* to)
+    {
+      for (std::size_t i(0); i < m_size; ++ i)
+      {
+        if (!m_groups[i].matched)
+          continue;
+        m_groups[i].first = to + (m_groups[i].first - from);
+        m_groups[i].second = to + (m_groups[i].second - from);
+      }
+    }
+
+  private:
+    friend class pattern;
+    std::array<submatch, max_size> m_groups;
+    std::size_t m_size = 0;
+    submatch m_unmatched;
+  };
+
+  /// ECMAScript-like regular expression compiled once into a Pike VM program
+  /// (a tagged NFA), which is then turned into a tagged DFA: every DFA state
+  /// is the ordered list of NFA threads alive at that point and every
+  /// transition says which thread each new one continues and which capture
+  /// slots it sets. Matching is one table lookup per character plus copying
+  /// a few capture offsets, never backtracks and never allocates. Patterns
+  /// whose DFA would be too large, or that use `\b`, run on the NFA instead.
+  ///
+  /// Whether a query matches, and group 0, agree with `std::regex_match`, and
+  /// threads are preferred leftmost-first the same way. Captures inside a
+  /// quantified group can differ: `*` and `+` never take an extra iteration
+  /// that matches empty, as ECMAScript requires and libstdc++ does not
+  /// (`(a*)*b` on "ab" gives "a", not ""), but the optional copies of a
+  /// `{n,m}` may (`(a*){1,2}b` on "ab" gives ""), and a group left unset by
+  /// the last iteration keeps the value of an earlier one instead of being
+  /// reset (`(?:(a)|b)+` on "ab" gives "a", not unset).
+  ///
+  /// Supported: literals, `.`, `[...]` classes and ranges, `\d \w \s` and
+  /// their negations, `\b \B`, `^ $`, `(...)`, `(?:...)`, `|`, and greedy
+  /// or lazy `* + ? {n} {n,} {n,m}`. Anything else throws `bad_pattern`.
+  class pattern
+  {
+  public:
+    pattern(const char* source, std::size_t source_size);
+    pattern(const std::string& source) : pattern(source.data(), source.size()) { }
+
+    inline std::size_t groups() const { return m_groups; }
+    bool matches(const char* query, std::size_t query_size, match& m) const;
+    inline bool matches(const std::string& query, match& m) const { return matches(query.data(), query.size(), m); }
+
+  private:
+    enum opcode : uint8_t
+    {
+      op_char,
+      op_any,
+      op_class,
+      op_split,
+      op_jmp,
+      op_save,
+      op_bol,
+      op_eol,
+      op_word,
+      op_not_word,
+      op_match,
+    };
+    struct inst
+    {
+      opcode op;
+      uint8_t c;
+      uint32_t x;
+      uint32_t y;
+    };
+    using charset = std::array<uint64_t, 4>;
+
+    /// Thread `n` of the target state continues thread `from` of the source
+    /// state (`none` for a fresh one) and sets `saves[first, first + count)`.
+    struct step
+    {
+      uint32_t from;
+      uint32_t first;
+      uint32_t count;
+    };
+    /// `in_place` when every thread continues itself, which is the case
+    /// inside most loops, so the offsets do not need to be copied.
+    struct transition
+    {
+      uint32_t next;
+      uint32_t first;
+      uint32_t threads;
+      bool in_place;
+    };
+    struct state
+    {
+      uint32_t threads;
+      uint32_t accept;
+      step accept_step;
+    };
+    static constexpr uint32_t none = ~uint32_t(0);
+
+    std::vector<inst> m_program;
+    std::vector<charset> m_classes;
+    std::size_t m_groups = 1;
+
+    std::array<uint8_t, 256> m_byte_class;
+    std::size_t m_class_count = 0;
+    std::vector<state> m_states;
+    std::vector<transition> m_transitions;
+    std::vector<step> m_steps;
+    std::vector<uint32_t> m_saves;
+    transition m_start = { none, 0, 0, false };
+    std::size_t m_max_threads = 0;
+
+    bool run_program(const char* query, std::size_t query_size, match& m) const;
+    bool run_automaton(const char* query, std::size_t query_size, match& m) const;
+
+    class compiler;
+    class automaton;
+  };
+}
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef QUEUE_HPP
+#define QUEUE_HPP
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <climits>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+namespace customsh
+{
+  /// Bounded lock-free multi-producer/multi-consumer ring (Vyukov's
+  /// sequence-per-cell scheme). Consumers that find it empty spin for a
+  /// moment and then park on a futex; producers only make a syscall when
+  /// somebody is actually parked. Producers never wait either: when the ring
+  /// is full, elements go to a locked overflow list the consumers drain once
+  /// the ring is empty.
+  template<typename T>
+  class queue
+  {
+    struct cell
+    {
+      std::atomic<std::size_t> sequence;
+      T data;
+    };
+
+    queue(const queue&) = delete;
+    queue(const queue&&) = delete;
+
+    const std::size_t m_mask;
+    std::unique_ptr<cell[]> m_cells;
+    alignas(64) std::atomic<std::size_t> m_enqueue;
+    alignas(64) std::atomic<std::size_t> m_dequeue;
+    alignas(64) std::atomic<uint32_t> m_epoch;
+    std::atomic<uint32_t> m_sleepers;
+    std::atomic<bool> m_closed;
+    alignas(64) std::atomic<std::size_t> m_overflowed;
+    std::mutex m_overflow_mutex;
+    std::deque<T> m_overflow;
+
+    static inline void futex(std::atomic<uint32_t>& word, int op, uint32_t value)
+    {
+      ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), op, value, nullptr, nullptr, 0);
+    }
+
+    static inline void relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+    }
+
+    inline void wake(uint32_t count)
+    {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (m_sleepers.load(std::memory_order_relaxed))
+      {
+        m_epoch.fetch_add(1, std::memory_order_release);
+        futex(m_epoch, FUTEX_WAKE_PRIVATE, count);
+      }
+    }
+
+  public:
+    /// `capacity` is rounded up to a power of two.
+    queue(std::size_t capacity = 1 << 14)
+      : m_mask([capacity]()
+        {
+          std::size_t size(2);
+          while (size < capacity)
+            size <<= 1;
+          return size - 1;
+        }())
+      , m_cells(new cell[m_mask + 1])
+      , m_enqueue(0)
+      , m_dequeue(0)
+      , m_epoch(0)
+      , m_sleepers(0)
+      , m_closed(false)
+      , m_overflowed(0)
+    {
+      for (std::size_t i(0); i <= m_mask; ++ i)
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_put(T& value)
+    {
+      auto pos(m_enqueue.load(std::memory_order_relaxed));
+      while (true)
+      {
+        auto& c(m_cells[pos & m_mask]);
+        const auto seq(c.sequence.load(std::memory_order_acquire));
+        const auto diff(intptr_t(seq) - intptr_t(pos));
+        if (diff == 0)
+        {
+          if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          {
+            c.data = std::move(value);
+            c.sequence.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (diff < 0)
+        {
+          return false;
+        }
+        else
+        {
+          pos = m_enqueue.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    /// Takes from the ring first, then from the overflow, which only fills
+    /// once the ring is full and takes every put until it is empty again, so
+    /// the order is kept.
+    bool try_get(T& value)
+    {
+      auto pos(m_dequeue.load(std::memory_order_relaxed));
+      while (true)
+      {
+        auto& c(m_cells[pos & m_mask]);
+        const auto seq(c.sequence.load(std::memory_order_acquire));
+        const auto diff(intptr_t(seq) - intptr_t(pos + 1));
+        if (diff == 0)
+        {
+          if (m_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          {
+            value = std::move(c.data);
+            c.data = T();
+            c.sequence.store(pos + m_mask + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (diff < 0)
+        {
+          if (!m_overflowed.load(std::memory_order_acquire))
+            return false;
+          std::lock_guard<std::mutex> locker(m_overflow_mutex);
+          if (m_overflow.empty())
+            return false;
+          value = std::move(m_overflow.front());
+          m_overflow.pop_front();
+          m_overflowed.store(m_overflow.size(), std::memory_order_release);
+          return true;
+        }
+        else
+        {
+          pos = m_dequeue.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    /// Never waits: workers put from their own loop, so waiting for one of
+    /// them to make room could wait forever. Past a full ring, which only
+    /// happens when the workers are far behind, it costs a lock.
+    void put(T value)
+    {
+      if (m_overflowed.load(std::memory_order_acquire) || !try_put(value))
+      {
+        std::lock_guard<std::mutex> locker(m_overflow_mutex);
+        m_overflow.push_back(std::move(value));
+        m_overflowed.store(m_overflow.size(), std::memory_order_release);
+      }
+      wake(1);
+    }
+
+    /// Blocks until an element is available or `close()` was called, in
+    /// which case it returns false.
+    bool get(T& value)
+    {
+      for (int spin(0); spin < 128; ++ spin)
+      {
+        if (try_get(value))
+          return true;
+        relax();
+      }
+      while (!m_closed.load(std::memory_order_acquire))
+      {
+        const auto epoch(m_epoch.load(std::memory_order_acquire));
+        m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+        if (try_get(value))
+        {
+          m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+          return true;
+        }
+        if (m_closed.load(std::memory_order_acquire))
+        {
+          m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+          break;
+        }
+        futex(m_epoch, FUTEX_WAIT_PRIVATE, epoch);
+        m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+        if (try_get(value))
+          return true;
+      }
+      return false;
+    }
+
+    /// Wakes every parked consumer for good.
+    void close()
+    {
+      m_closed.store(true, std::memory_order_release);
+      m_epoch.fetch_add(1, std::memory_order_release);
+      futex(m_epoch, FUTEX_WAKE_PRIVATE, INT_MAX);
+    }
+  };
+}
+
+#endif
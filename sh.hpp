@@ -5,11 +5,15 @@
 #include <sys/signal.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
 #include <memory>
 #include <initializer_list>
 #include <exception>
+#include <system_error>
 #include <ext/stdio_filebuf.h>
 #include <iostream>
+#include "spawner.hpp"
 
 namespace sh
 {
@@ -56,6 +60,8 @@ namespace sh
     stream m_out;
     stream m_err;
     int m_pid = 0;
+    /* Set when the spawner started the child: its wait status arrives here. */
+    int m_status = -1;
 
     sh(sh const&) = delete;
     sh(sh&&) = delete;
@@ -63,58 +69,35 @@ namespace sh
     sh& operator=(sh &&) = delete;
 
   public:
+    /// Runs `args` with its stdin, stdout and stderr on pipes. Spawned with
+    /// posix_spawn, which clones with CLONE_VFORK and reports a failed exec
+    /// as an error instead of a child exiting with some code. The child only
+    /// keeps fds 0-2: the pipes are CLOEXEC and everything else is closed
+    /// with close_range, one syscall whatever RLIMIT_NOFILE is. Goes through
+    /// the `spawner` helper when it runs. Throws `std::system_error` when the
+    /// command cannot be started.
     template<typename... Args>
     sh(Args... args)
     {
-      union
+      const char* argv[] = { toChars(args)..., nullptr };
+      if (spawner::enabled())
       {
-        struct
+        int fds[4];
+        pid_t pid;
+        const int spawned(spawner::spawn(argv, fds, pid));
+        if (spawned > 0)
+          throw std::system_error(spawned, std::system_category(), argv[0]);
+        if (!spawned)
         {
-          int r;
-          int w;
-        };
-        int fds[2];
-      } fifo_in, fifo_out, fifo_err;
-      if (::pipe(fifo_in.fds) < 0)
-        throw std::exception();
-      if (::pipe(fifo_out.fds) < 0)
-      {
-        ::close(fifo_in.r);
-        ::close(fifo_in.w);
-        throw std::exception();
-      }
-      if (::pipe(fifo_err.fds) < 0)
-      {
-        ::close(fifo_in.r);
-        ::close(fifo_in.w);
-        ::close(fifo_out.r);
-        ::close(fifo_out.w);
-        throw std::exception();
-      }
-      m_pid = ::vfork();
-      if (m_pid < 0)
-      {
-        throw std::exception();
-      }
-      else if (m_pid)
-      {
-        ::close(fifo_in.r);
-        ::close(fifo_out.w);
-        ::close(fifo_err.w);
-        m_in.fd(fifo_in.w, std::ios::out);
-        m_out.fd(fifo_out.r, std::ios::in);
-        m_err.fd(fifo_err.r, std::ios::in);
-      }
-      else
-      {
-        const char* argv[] = { toChars(args)..., nullptr };
-        ::dup2(fifo_in.r, STDIN_FILENO);
-        ::dup2(fifo_out.w, STDOUT_FILENO);
-        ::dup2(fifo_err.w, STDERR_FILENO);
-        for (auto i(sysconf(_SC_OPEN_MAX)); i >= 3; -- i)
-          ::close(i);
-        ::_exit(::execvp(argv[0], (char* const*)argv));
+          m_pid = pid;
+          m_status = fds[3];
+          m_in.fd(fds[0], std::ios::out);
+          m_out.fd(fds[1], std::ios::in);
+          m_err.fd(fds[2], std::ios::in);
+          return;
+        }
       }
+      spawn(argv);
     }
     virtual ~sh()
     {
@@ -132,7 +115,19 @@ namespace sh
       {
         throw std::exception();
       }
-      union wait pstat;
+      int pstat = 0;
+      if (m_status >= 0)
+      {
+        ssize_t n;
+        do
+        {
+          n = ::read(m_status, &pstat, sizeof(pstat));
+        }
+        while (n < 0 && errno == EINTR);
+        ::close(m_status);
+        m_status = -1;
+        return n == sizeof(pstat) ? WEXITSTATUS(pstat) : -1;
+      }
       int pid;
       sigset_t nmask;
       ::sigemptyset(&nmask);
@@ -143,11 +138,11 @@ namespace sh
       ::sigprocmask(SIG_BLOCK, &nmask, &omask);
       do
       {
-        pid = ::waitpid(m_pid, &pstat.w_status, 0);
+        pid = ::waitpid(m_pid, &pstat, 0);
       }
       while (pid < 0 && errno == EINTR);
       ::sigprocmask(SIG_SETMASK, &omask, NULL);
-      return pid < 0 ? -1 : pstat.__wait_terminated.__w_retcode;
+      return pid < 0 ? -1 : WEXITSTATUS(pstat);
     }
     inline int retcode()
     {
@@ -160,6 +155,75 @@ namespace sh
       m_err.close();
       return wait();
     }
+
+  private:
+    inline void spawn(const char* const* argv)
+    {
+      union
+      {
+        struct
+        {
+          int r;
+          int w;
+        };
+        int fds[2];
+      } fifo_in, fifo_out, fifo_err;
+      if (::pipe2(fifo_in.fds, O_CLOEXEC) < 0)
+        throw std::system_error(errno, std::system_category(), "pipe");
+      if (::pipe2(fifo_out.fds, O_CLOEXEC) < 0)
+      {
+        const int _errno(errno);
+        ::close(fifo_in.r);
+        ::close(fifo_in.w);
+        throw std::system_error(_errno, std::system_category(), "pipe");
+      }
+      if (::pipe2(fifo_err.fds, O_CLOEXEC) < 0)
+      {
+        const int _errno(errno);
+        ::close(fifo_in.r);
+        ::close(fifo_in.w);
+        ::close(fifo_out.r);
+        ::close(fifo_out.w);
+        throw std::system_error(_errno, std::system_category(), "pipe");
+      }
+
+      posix_spawn_file_actions_t actions;
+      ::posix_spawn_file_actions_init(&actions);
+      ::posix_spawn_file_actions_adddup2(&actions, fifo_in.r, STDIN_FILENO);
+      ::posix_spawn_file_actions_adddup2(&actions, fifo_out.w, STDOUT_FILENO);
+      ::posix_spawn_file_actions_adddup2(&actions, fifo_err.w, STDERR_FILENO);
+      ::posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+      /* The daemon ignores SIGINT and SIGHUP, the command should not. */
+      posix_spawnattr_t attr;
+      ::posix_spawnattr_init(&attr);
+      sigset_t defaults;
+      ::sigemptyset(&defaults);
+      ::sigaddset(&defaults, SIGINT);
+      ::sigaddset(&defaults, SIGHUP);
+      ::sigaddset(&defaults, SIGPIPE);
+      ::posix_spawnattr_setsigdefault(&attr, &defaults);
+      ::posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+      pid_t pid;
+      const int spawned(::posix_spawnp(&pid, argv[0], &actions, &attr, (char* const*)argv, environ));
+      ::posix_spawn_file_actions_destroy(&actions);
+      ::posix_spawnattr_destroy(&attr);
+
+      ::close(fifo_in.r);
+      ::close(fifo_out.w);
+      ::close(fifo_err.w);
+      if (spawned)
+      {
+        ::close(fifo_in.w);
+        ::close(fifo_out.r);
+        ::close(fifo_err.r);
+        throw std::system_error(spawned, std::system_category(), argv[0]);
+      }
+      m_pid = pid;
+      m_in.fd(fifo_in.w, std::ios::out);
+      m_out.fd(fifo_out.r, std::ios::in);
+      m_err.fd(fifo_err.r, std::ios::in);
+    }
   };
 }
 
@@ -0,0 +1,326 @@
+#include <map>
+#include <mutex>
+#include <string>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <spawn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include "spawner.hpp"
+
+namespace sh
+{
+  namespace
+  {
+    const std::size_t max_request = 64 * 1024;
+
+    struct reply
+    {
+      int32_t error;
+      int32_t pid;
+    };
+
+    int s_socket = -1;
+    std::mutex s_mutex;
+    std::atomic<bool> s_enabled(false);
+
+    bool send_fds(int sock, const void* data, std::size_t size, const int* fds, int count)
+    {
+      iovec iov = { const_cast<void*>(data), size };
+      char control[CMSG_SPACE(4 * sizeof(int))];
+      msghdr msg;
+      std::memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      if (count)
+      {
+        std::memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        auto cmsg(CMSG_FIRSTHDR(&msg));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+      }
+      ssize_t n;
+      do
+      {
+        n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+      }
+      while (n < 0 && errno == EINTR);
+      return n == ssize_t(size);
+    }
+
+    /// Returns the size of the message, 0 on EOF, -1 on error. `count` gets
+    /// the number of fds that came with it, all CLOEXEC.
+    ssize_t recv_fds(int sock, void* data, std::size_t size, int* fds, int& count)
+    {
+      iovec iov = { data, size };
+      char control[CMSG_SPACE(4 * sizeof(int))];
+      msghdr msg;
+      std::memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      ssize_t n;
+      do
+      {
+        n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+      }
+      while (n < 0 && errno == EINTR);
+      count = 0;
+      for (auto cmsg(CMSG_FIRSTHDR(&msg)); n >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+      {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+          count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+          std::memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+        }
+      }
+      return n;
+    }
+
+    /// Writes the wait status of every exited child to its status pipe.
+    void reap(std::map<pid_t, int>& statuses)
+    {
+      int status;
+      pid_t pid;
+      while ((pid = ::waitpid(-1, &status, WNOHANG)) > 0)
+      {
+        auto i(statuses.find(pid));
+        if (i == statuses.end())
+          continue;
+        if (::write(i->second, &status, sizeof(status)) < 0)
+        {
+          /* Nobody waits for it any more. */
+        }
+        ::close(i->second);
+        statuses.erase(i);
+      }
+    }
+
+    /// Starts one command, in the namespaces of `ns` when given. Returns
+    /// the reply and, on success, the fds to hand back.
+    reply run(char* const* argv, const int* ns, int ns_count, int own_net, int own_mnt, int (&out)[4], std::map<pid_t, int>& statuses)
+    {
+      reply r = { 0, 0 };
+      int fifo[4][2];
+      int made(0);
+      for (; made < 4; ++ made)
+      {
+        if (::pipe2(fifo[made], O_CLOEXEC) < 0)
+        {
+          r.error = errno;
+          break;
+        }
+      }
+      if (!r.error && ns_count == 2 && (::setns(ns[0], CLONE_NEWNET) < 0 || ::setns(ns[1], CLONE_NEWNS) < 0))
+        r.error = errno;
+
+      if (!r.error)
+      {
+        posix_spawn_file_actions_t actions;
+        ::posix_spawn_file_actions_init(&actions);
+        ::posix_spawn_file_actions_adddup2(&actions, fifo[0][0], STDIN_FILENO);
+        ::posix_spawn_file_actions_adddup2(&actions, fifo[1][1], STDOUT_FILENO);
+        ::posix_spawn_file_actions_adddup2(&actions, fifo[2][1], STDERR_FILENO);
+        ::posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+        posix_spawnattr_t attr;
+        ::posix_spawnattr_init(&attr);
+        sigset_t defaults;
+        ::sigemptyset(&defaults);
+        ::sigaddset(&defaults, SIGINT);
+        ::sigaddset(&defaults, SIGHUP);
+        ::sigaddset(&defaults, SIGPIPE);
+        ::sigaddset(&defaults, SIGTERM);
+        ::posix_spawnattr_setsigdefault(&attr, &defaults);
+        sigset_t none;
+        ::sigemptyset(&none);
+        ::posix_spawnattr_setsigmask(&attr, &none);
+        ::posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+        pid_t pid;
+        r.error = ::posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+        ::posix_spawn_file_actions_destroy(&actions);
+        ::posix_spawnattr_destroy(&attr);
+        if (!r.error)
+        {
+          r.pid = pid;
+          statuses[pid] = fifo[3][1];
+          out[0] = fifo[0][1];
+          out[1] = fifo[1][0];
+          out[2] = fifo[2][0];
+          out[3] = fifo[3][0];
+          ::close(fifo[0][0]);
+          ::close(fifo[1][1]);
+          ::close(fifo[2][1]);
+        }
+      }
+      if (ns_count == 2)
+      {
+        ::setns(own_net, CLONE_NEWNET);
+        ::setns(own_mnt, CLONE_NEWNS);
+      }
+      if (r.error)
+      {
+        for (int i(0); i < made; ++ i)
+        {
+          ::close(fifo[i][0]);
+          ::close(fifo[i][1]);
+        }
+      }
+      return r;
+    }
+
+    /// The helper process: serves spawn requests until the daemon closes its
+    /// end of the socket.
+    [[noreturn]] void helper(int sock)
+    {
+      ::dup2(sock, 3);
+      sock = 3;
+      ::close_range(4, ~0U, 0);
+      ::setsid();
+
+      sigset_t mask;
+      ::sigemptyset(&mask);
+      ::sigaddset(&mask, SIGCHLD);
+      ::sigprocmask(SIG_BLOCK, &mask, nullptr);
+      const int child(::signalfd(-1, &mask, SFD_CLOEXEC));
+      const int own_net(::open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC));
+      const int own_mnt(::open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC));
+
+      std::map<pid_t, int> statuses;
+      static char request[max_request];
+      pollfd fds[2] = { { sock, POLLIN, 0 }, { child, POLLIN, 0 } };
+      while (true)
+      {
+        if (::poll(fds, 2, -1) < 0)
+          continue;
+        if (fds[1].revents & POLLIN)
+        {
+          signalfd_siginfo info;
+          if (::read(child, &info, sizeof(info)) < 0)
+          {
+            /* Reaping below is what matters. */
+          }
+          reap(statuses);
+        }
+        if (!fds[0].revents)
+          continue;
+
+        int ns[4];
+        int ns_count;
+        const auto size(recv_fds(sock, request, sizeof(request) - 1, ns, ns_count));
+        if (size <= 0)
+          ::_exit(0);
+        request[size] = 0;
+        char* argv[1024];
+        std::size_t argc(0);
+        for (char* p(request); p < request + size && argc < sizeof(argv) / sizeof(*argv) - 1; p += std::strlen(p) + 1)
+          argv[argc ++] = p;
+        argv[argc] = nullptr;
+
+        int out[4];
+        reply r(argc ? run(argv, ns, ns_count, own_net, own_mnt, out, statuses) : reply { EINVAL, 0 });
+        for (int i(0); i < ns_count; ++ i)
+          ::close(ns[i]);
+        send_fds(sock, &r, sizeof(r), out, r.error ? 0 : 4);
+        if (!r.error)
+        {
+          for (auto fd : out)
+            ::close(fd);
+        }
+      }
+    }
+  }
+
+  bool spawner::start()
+  {
+    int pair[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0)
+      return false;
+    /* Forked twice so the helper is not our child: waitpid on commands stays unaffected and no zombie is left. */
+    const pid_t pid(::fork());
+    if (pid < 0)
+    {
+      ::close(pair[0]);
+      ::close(pair[1]);
+      return false;
+    }
+    if (!pid)
+    {
+      ::close(pair[0]);
+      if (::fork() == 0)
+        helper(pair[1]);
+      ::_exit(0);
+    }
+    ::close(pair[1]);
+    int status;
+    ::waitpid(pid, &status, 0);
+    s_socket = pair[0];
+    s_enabled = true;
+    return true;
+  }
+
+  bool spawner::enabled()
+  {
+    return s_enabled.load(std::memory_order_relaxed);
+  }
+
+  int spawner::spawn(const char* const* argv, int (&fds)[4], pid_t& pid)
+  {
+    std::string request;
+    for (auto arg(argv); *arg; ++ arg)
+      request.append(*arg).append(1, '\0');
+    if (request.size() >= max_request)
+      return E2BIG;
+
+    /* The command runs where the calling thread is, which ns::net may have moved. */
+    int ns[2] =
+    {
+      ::open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC),
+      ::open("/proc/thread-self/ns/mnt", O_RDONLY | O_CLOEXEC),
+    };
+    const int ns_count(ns[0] >= 0 && ns[1] >= 0 ? 2 : 0);
+
+    reply r;
+    int count(0);
+    ssize_t size(-1);
+    {
+      std::lock_guard<std::mutex> locker(s_mutex);
+      if (send_fds(s_socket, request.data(), request.size(), ns, ns_count))
+        size = recv_fds(s_socket, &r, sizeof(r), fds, count);
+    }
+    for (auto fd : ns)
+    {
+      if (fd >= 0)
+        ::close(fd);
+    }
+    if (size != sizeof(r))
+    {
+      for (int i(0); i < count; ++ i)
+        ::close(fds[i]);
+      s_enabled = false;
+      return -1;
+    }
+    if (r.error)
+      return r.error;
+    if (count != 4)
+    {
+      for (int i(0); i < count; ++ i)
+        ::close(fds[i]);
+      return EPROTO;
+    }
+    pid = r.pid;
+    return 0;
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef SPAWNER_HPP
+#define SPAWNER_HPP
+
+#include <sys/types.h>
+
+namespace sh
+{
+  /// Optional helper process that starts commands for `sh::sh`. It is forked
+  /// while the daemon is still small and single threaded, and receives spawn
+  /// requests over a socketpair. The command runs in the caller's network
+  /// and mount namespaces. The child's pipes, plus one more pipe that
+  /// delivers its wait status once the helper has reaped it, come back over
+  /// SCM_RIGHTS. The cost of a spawn then no longer depends on the daemon's
+  /// size or thread count.
+  class spawner
+  {
+  public:
+    /// Forks the helper. Returns false when it could not be started, in
+    /// which case `sh::sh` keeps spawning by itself.
+    static bool start();
+    static bool enabled();
+
+    /// Runs `argv` through the helper. On success fills `fds` with the
+    /// child's stdin writer, stdout reader, stderr reader and status
+    /// reader and returns 0. Returns the errno of a failed exec, or -1 when
+    /// the helper is gone and the caller should spawn by itself.
+    static int spawn(const char* const* argv, int (&fds)[4], pid_t& pid);
+  };
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef TASK_HPP
+#define TASK_HPP
+
+#include <utility>
+#include <optional>
+#include <exception>
+#include <coroutine>
+
+namespace customsh
+{
+  template<typename T>
+  class task;
+
+  namespace detail
+  {
+    struct promise_base
+    {
+      std::coroutine_handle<> continuation;
+      std::exception_ptr error;
+
+      /// Resumes whoever awaited the task, nothing when it was never awaited.
+      struct final_awaiter
+      {
+        bool await_ready() const noexcept { return false; }
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> self) noexcept
+        {
+          auto next(self.promise().continuation);
+          return next ? next : std::noop_coroutine();
+        }
+        void await_resume() const noexcept { }
+      };
+
+      std::suspend_always initial_suspend() const noexcept { return {}; }
+      final_awaiter final_suspend() const noexcept { return {}; }
+      void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    template<typename T>
+    struct promise : public promise_base
+    {
+      std::optional<T> value;
+
+      task<T> get_return_object();
+      template<typename U>
+      void return_value(U&& _value) { value.emplace(std::forward<U>(_value)); }
+      T result()
+      {
+        if (error)
+          std::rethrow_exception(error);
+        return std::move(*value);
+      }
+    };
+
+    template<>
+    struct promise<void> : public promise_base
+    {
+      task<void> get_return_object();
+      void return_void() { }
+      void result()
+      {
+        if (error)
+          std::rethrow_exception(error);
+      }
+    };
+
+    /// A coroutine nobody waits for, it frees itself when done.
+    struct detached
+    {
+      struct promise_type
+      {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() { }
+        void unhandled_exception() { std::terminate(); }
+      };
+    };
+  }
+
+  /// Result of a coroutine handler or of anything it awaits. Lazy: the body
+  /// only starts when the task is `co_await`ed, and the awaiting coroutine
+  /// resumes right where the task ends, on whichever thread that is. An
+  /// exception thrown in the body comes out of the `co_await`.
+  template<typename T = void>
+  class task
+  {
+  public:
+    using promise_type = detail::promise<T>;
+
+    task(task&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) { }
+    ~task()
+    {
+      if (m_handle)
+        m_handle.destroy();
+    }
+
+    auto operator co_await() && noexcept
+    {
+      struct awaiter
+      {
+        std::coroutine_handle<promise_type> handle;
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+        {
+          handle.promise().continuation = caller;
+          return handle;
+        }
+        T await_resume() { return handle.promise().result(); }
+      };
+      return awaiter { m_handle };
+    }
+
+  private:
+    friend promise_type;
+    explicit task(std::coroutine_handle<promise_type> _handle) : m_handle(_handle) { }
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    std::coroutine_handle<promise_type> m_handle;
+  };
+
+  namespace detail
+  {
+    template<typename T>
+    inline task<T> promise<T>::get_return_object()
+    {
+      return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+    }
+
+    inline task<void> promise<void>::get_return_object()
+    {
+      return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+    }
+  }
+}
+
+#endif
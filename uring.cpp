@@ -0,0 +1,181 @@
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.hpp"
+
+namespace customsh
+{
+  static void fail(const char* what)
+  {
+    throw std::system_error(errno, std::system_category(), what);
+  }
+
+  static void* map(int fd, std::size_t size, off_t offset)
+  {
+    auto p(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset));
+    return p == MAP_FAILED ? nullptr : p;
+  }
+
+  uring::uring(unsigned entries, unsigned buffer_count, unsigned buffer_size)
+  {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    /* Only the reactor thread submits, and completions are only needed when it asks for them. */
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    m_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (m_fd < 0 && errno == EINVAL)
+    {
+      std::memset(&params, 0, sizeof(params));
+      m_fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (m_fd < 0)
+      fail("io_uring_setup");
+    m_features = params.features;
+    if (!(m_features & IORING_FEAT_EXT_ARG))
+    {
+      errno = ENOSYS;
+      release();
+      fail("io_uring_setup");
+    }
+
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (m_features & IORING_FEAT_SINGLE_MMAP)
+      m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+    m_sq_ring = map(m_fd, m_sq_ring_size, IORING_OFF_SQ_RING);
+    m_cq_ring = (m_features & IORING_FEAT_SINGLE_MMAP) ? m_sq_ring : map(m_fd, m_cq_ring_size, IORING_OFF_CQ_RING);
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = static_cast<io_uring_sqe*>(map(m_fd, m_sqes_size, IORING_OFF_SQES));
+    if (!m_sq_ring || !m_cq_ring || !m_sqes)
+    {
+      release();
+      fail("io_uring mmap");
+    }
+
+    auto sq(static_cast<char*>(m_sq_ring));
+    m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sq_entries = params.sq_entries;
+    auto cq(static_cast<char*>(m_cq_ring));
+    m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+
+    /* The provided buffer ring needs a power of two entries, page aligned. */
+    m_buffer_count = 1;
+    while (m_buffer_count < buffer_count)
+      m_buffer_count <<= 1;
+    m_buffer_size = buffer_size;
+    m_buffer_ring_size = m_buffer_count * sizeof(io_uring_buf);
+    auto ring(mmap(nullptr, m_buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (ring == MAP_FAILED)
+    {
+      release();
+      fail("io_uring buffer ring");
+    }
+    m_buffer_ring = static_cast<io_uring_buf*>(ring);
+    m_buffers = new char[m_buffer_count * m_buffer_size];
+
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(m_buffer_ring);
+    reg.ring_entries = m_buffer_count;
+    reg.bgid = buffer_group;
+    if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+      release();
+      fail("io_uring_register");
+    }
+    for (unsigned i(0); i < m_buffer_count; ++ i)
+      recycle(i);
+  }
+
+  uring::~uring()
+  {
+    release();
+  }
+
+  void uring::release()
+  {
+    if (m_fd >= 0)
+      close(m_fd);
+    m_fd = -1;
+    if (m_buffer_ring)
+      munmap(m_buffer_ring, m_buffer_ring_size);
+    m_buffer_ring = nullptr;
+    delete[] m_buffers;
+    m_buffers = nullptr;
+    if (m_sqes)
+      munmap(m_sqes, m_sqes_size);
+    m_sqes = nullptr;
+    if (m_cq_ring && m_cq_ring != m_sq_ring)
+      munmap(m_cq_ring, m_cq_ring_size);
+    m_cq_ring = nullptr;
+    if (m_sq_ring)
+      munmap(m_sq_ring, m_sq_ring_size);
+    m_sq_ring = nullptr;
+  }
+
+  io_uring_sqe* uring::sqe()
+  {
+    auto tail(*m_sq_tail + m_sq_pending);
+    if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+    {
+      submit();
+      tail = *m_sq_tail + m_sq_pending;
+    }
+    const auto index(tail & m_sq_mask);
+    m_sq_array[index] = index;
+    ++ m_sq_pending;
+    auto sqe(&m_sqes[index]);
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  int uring::submit(unsigned wait, int timeout_ms)
+  {
+    const auto count(m_sq_pending);
+    __atomic_store_n(m_sq_tail, *m_sq_tail + count, __ATOMIC_RELEASE);
+    m_sq_pending = 0;
+
+    unsigned flags(wait ? IORING_ENTER_GETEVENTS : 0);
+    io_uring_getevents_arg arg;
+    __kernel_timespec ts;
+    const void* argp(nullptr);
+    std::size_t argsz(0);
+    if (wait && timeout_ms >= 0)
+    {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+      std::memset(&arg, 0, sizeof(arg));
+      arg.ts = reinterpret_cast<uint64_t>(&ts);
+      flags |= IORING_ENTER_EXT_ARG;
+      argp = &arg;
+      argsz = sizeof(arg);
+    }
+    if (!count && !flags)
+      return 0;
+    auto ret(syscall(__NR_io_uring_enter, m_fd, count, wait, flags, argp, argsz));
+    if (ret < 0 && (errno == EINTR || errno == ETIME || errno == EAGAIN || errno == EBUSY))
+      return 0;
+    return ret;
+  }
+
+  void uring::recycle(uint16_t id)
+  {
+    auto& b(m_buffer_ring[m_buffer_tail & (m_buffer_count - 1)]);
+    b.addr = reinterpret_cast<uint64_t>(m_buffers + std::size_t(id) * m_buffer_size);
+    b.len = m_buffer_size;
+    b.bid = id;
+    ++ m_buffer_tail;
+    /* The ring tail overlays the reserved field of the first entry. */
+    __atomic_store_n(&reinterpret_cast<io_uring_buf_ring*>(m_buffer_ring)->tail, m_buffer_tail, __ATOMIC_RELEASE);
+  }
+}
@@ -0,0 +1,82 @@
+#ifndef URING_HPP
+#define URING_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <linux/io_uring.h>
+
+namespace customsh
+{
+  /// Just enough of io_uring for the event loop, on the raw syscalls: one
+  /// submission and one completion ring mapped into the process, plus one
+  /// ring of provided receive buffers the kernel picks from. Owned and used
+  /// by a single thread. Setup failures throw `std::system_error`.
+  class uring
+  {
+    uring(const uring&) = delete;
+    uring(const uring&&) = delete;
+  public:
+    uring(unsigned entries, unsigned buffer_count, unsigned buffer_size);
+    ~uring();
+
+    /// Next free submission entry, zeroed. Submits what is queued first
+    /// when the ring is full.
+    io_uring_sqe* sqe();
+    /// Submits everything queued and waits for at least `wait` completions,
+    /// but no longer than `timeout_ms`.
+    int submit(unsigned wait = 0, int timeout_ms = -1);
+
+    /// Calls `f(const io_uring_cqe&)` for every pending completion.
+    template<typename F>
+    unsigned reap(F f)
+    {
+      unsigned count(0);
+      auto head(*m_cq_head);
+      const auto tail(__atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE));
+      for (; head != tail; ++ head, ++ count)
+        f(m_cqes[head & m_cq_mask]);
+      __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+      return count;
+    }
+
+    /// Provided receive buffers, all in buffer group `buffer_group`.
+    static constexpr uint16_t buffer_group = 0;
+    inline const char* buffer(uint16_t id) const { return m_buffers + std::size_t(id) * m_buffer_size; }
+    /// Hands a buffer the kernel filled back to it.
+    void recycle(uint16_t id);
+
+  private:
+    int m_fd = -1;
+    unsigned m_features = 0;
+
+    void* m_sq_ring = nullptr;
+    std::size_t m_sq_ring_size = 0;
+    void* m_cq_ring = nullptr;
+    std::size_t m_cq_ring_size = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    std::size_t m_sqes_size = 0;
+
+    unsigned* m_sq_head = nullptr;
+    unsigned* m_sq_tail = nullptr;
+    unsigned* m_sq_array = nullptr;
+    unsigned m_sq_mask = 0;
+    unsigned m_sq_entries = 0;
+    unsigned m_sq_pending = 0;
+
+    unsigned* m_cq_head = nullptr;
+    unsigned* m_cq_tail = nullptr;
+    io_uring_cqe* m_cqes = nullptr;
+    unsigned m_cq_mask = 0;
+
+    io_uring_buf* m_buffer_ring = nullptr;
+    std::size_t m_buffer_ring_size = 0;
+    unsigned m_buffer_count = 0;
+    uint16_t m_buffer_tail = 0;
+    char* m_buffers = nullptr;
+    std::size_t m_buffer_size = 0;
+
+    void release();
+  };
+}
+
+#endif